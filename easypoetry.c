@@ -4,23 +4,63 @@
 #define _BSD_SOURCE
 #define _GNU_SOURCE
 
+#include <assert.h>
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define KILO_AVX2
+#endif
 
 /* defines */
 
 #define KILO_TAB_STOP 8
+#define KILO_RX_STRIDE 128
+#define KILO_HL_WINDOW 256
+#define KILO_HL_RUN_MAX 0xFFFF
 #define KILO_QUIT_TIMES 3
+#define KILO_SPAN_LINES 1024
+#define KILO_ROW_CACHE 512
+#define KILO_ARENA_SIZE (1 << 20)
+#define KILO_SLAB_CLASSES 32
+#define KILO_PREFETCH_ROWS 8
+#define KILO_HL_BATCH_LINES 4096
+#define KILO_HL_THREADS 16
+#define KILO_FIND_HITS 256
+#define KILO_FIND_BATCH (1 << 20)
+#define KILO_FIND_NARROW 4096
+#define KILO_RE_INSTS 8192
+#define KILO_RE_REPEAT 256
+#define KILO_DFA_STATES 1024
+#define KILO_INPUT_SIZE 4096
+#define KILO_KEY_QUEUE 1024
+#define KILO_ESC_TIMEOUT 100
+#define KILO_MESSAGE_SECS 5
+#ifndef KILO_FRAME_RATE
+#define KILO_FRAME_RATE 60
+#endif
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -34,7 +74,8 @@ enum editor_key {
 	HOME_KEY,
 	END_KEY,
 	PAGE_UP,
-	PAGE_DOWN
+	PAGE_DOWN,
+	PASTE_KEY
 };
 
 enum editor_highlight {
@@ -51,8 +92,74 @@ enum editor_highlight {
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
 
+#define CLASS_SEP (1 << 0)
+#define CLASS_DIGIT (1 << 1)
+#define CLASS_COMMENT (1 << 2)
+#define CLASS_COMMENT_END (1 << 3)
+
+#define ROW_RENDER (1 << 0)
+#define ROW_HL (1 << 1)
+
+#define SCAN_TAB (1 << 0)
+#define SCAN_CTRL (1 << 1)
+#define SCAN_HIGH (1 << 2)
+
+#define WMAP_WIDTH 0x03
+#define WMAP_CONT 0x04
+#define WMAP_BAD 0x08
+
+#define CELL_DEFAULT 39
+#define CELL_REVERSE 0x80
+
+#define DFA_BOL (1 << 0)
+#define DFA_WORD (1 << 1)
+#define DFA_UNKNOWN -1
+#define DFA_MATCH -2
+
+enum sgr_kind {
+	SGR_COLOR = 0,
+	SGR_RESET,
+	SGR_REVERSE
+};
+
+enum re_op {
+	RE_RANGE = 0,
+	RE_SPLIT,
+	RE_JMP,
+	RE_BOL,
+	RE_EOL,
+	RE_WORDB,
+	RE_NWORDB,
+	RE_MATCH
+};
+
+enum re_node_kind {
+	RN_EMPTY = 0,
+	RN_CLASS,
+	RN_BYTE,
+	RN_CAT,
+	RN_ALT,
+	RN_REPEAT,
+	RN_ASSERT
+};
+
 /* data */
 
+struct keyword {
+	char *s;
+	int len;
+	int hl;
+};
+
+struct syntax_table {
+	unsigned char cls[256];
+	struct keyword *keywords;
+	unsigned int mask;
+	unsigned int seed;
+	int min_len;
+	int max_len;
+};
+
 struct editor_syntax {
 	char *filetype;
 	char **filematch;
@@ -61,18 +168,180 @@ struct editor_syntax {
 	char *multiline_comment_start;
 	char *multiline_comment_end;
 	int flags;
+	struct syntax_table *table;
+};
+
+struct col_mark {
+	int rb;
+	int rx;
+};
+
+struct hl_run {
+	unsigned short len;
+	unsigned char hl;
+};
+
+struct find_part {
+	const char *text;
+	const size_t *starts;
+	int line;
+	int len;
+};
+
+struct find_batch {
+	int first;
+	int count;
+	int part;
+	int *lines;
+	int n;
+	int cap;
+	int done;
+};
+
+struct needle {
+	unsigned char *s;
+	int len;
+	int fold;
+	int anchor;
+	unsigned char first[2];
+	unsigned char last[2];
+};
+
+struct re_inst {
+	unsigned char op;
+	unsigned char lo;
+	unsigned char hi;
+	int x;
+	int y;
+};
+
+struct regex {
+	struct re_inst *insts;
+	int count;
+	int cap;
+};
+
+struct re_node {
+	int kind;
+	int a;
+	int b;
+	int min;
+	int max;
+};
+
+struct re_parser {
+	const unsigned char *s;
+	int len;
+	int pos;
+	struct re_node *nodes;
+	int node_count;
+	int node_cap;
+	int (*ranges)[2];
+	int range_count;
+	int range_cap;
+	const char *error;
+};
+
+struct dfa_state {
+	int *pcs;
+	int n;
+	int flags;
+	int eol;
+	int next[256];
+};
+
+struct dfa {
+	struct regex *re;
+	struct dfa_state *states;
+	int count;
+	int *table;
+	int start;
+	int *list;
+	int *kernel;
+	int *stack;
+	int *mark;
+	int gen;
 };
 
 typedef struct erow {
-	int idx;
+	struct erow *left;
+	struct erow *right;
+	struct erow *parent;
+	int prio;
+	int count;
+	int lines;
+	int map_line;
 	int size;
 	int rsize;
+	int cap;
+	int render_cap;
+	int wmap_cap;
+	struct col_mark *marks;
+	int mark_count;
+	int mark_cap;
 	char *chars;
 	char *render;
-	unsigned char *hl;
+	unsigned char *wmap;
+	struct hl_run *runs;
+	int run_count;
+	int run_cap;
+	int run_hint;
+	int run_base;
+	int scan;
 	int hl_open_comment;
+	int hl_start;
+	int hl_gen;
+	int hl_min;
+	int valid;
+	int version;
+	int cache_slot;
 } erow;
 
+struct hl_job {
+	erow *row;
+	int version;
+	size_t text;
+	size_t len;
+	char *render;
+	int rsize;
+	struct hl_run *runs;
+	int run_count;
+	int clean;
+	int start;
+	int end;
+};
+
+struct cell {
+	char c[6];
+	unsigned char len;
+	unsigned char attr;
+};
+
+struct sgr_seq {
+	char s[12];
+	int len;
+};
+
+struct abuf {
+	char *b;
+	int len;
+	int cap;
+};
+
+#define ABUF_INIT {NULL, 0, 0}
+
+struct hl_chunk {
+	struct hl_job *jobs;
+	int n;
+	int done;
+	char *buf;
+	size_t cap;
+	unsigned char *hl;
+	int hl_cap;
+	int start;
+	struct editor_syntax *syntax;
+};
+
 struct editor_config {
 	int cx, cy;
 	int rx;
@@ -81,12 +350,103 @@ struct editor_config {
 	int screenrows;
 	int screencols;
 	int numrows;
-	erow *row;
+	erow *root;
+	char *map;
+	size_t map_size;
+	size_t *map_lines;
+	int map_heap;
+	erow *cache[KILO_ROW_CACHE];
+	long long cache_seen[KILO_ROW_CACHE];
+	int cache_next;
+	int hl_gen;
+	int hl_redraw;
+	int tree_gen;
+	pthread_mutex_t lock;
+	pthread_cond_t hl_cond;
+	struct hl_chunk hl_chunks[KILO_HL_THREADS];
+	int hl_threads;
+	int hl_next;
+	int hl_count;
+	int hl_pending;
+	pthread_mutex_t pool_lock;
+	pthread_cond_t pool_cond;
+	pthread_cond_t pool_done;
 	int dirty;
 	char *filename;
 	char statusmsg[80];
 	time_t statusmsg_time;
+	char *arenas;
+	char *arena;
+	int arena_left;
+	void *slab_free[KILO_SLAB_CLASSES];
 	struct editor_syntax *syntax;
+	unsigned char *hl;
+	int hl_cap;
+	struct hl_run *hl_runs;
+	int hl_runs_cap;
+	int match_line;
+	int match_at;
+	int match_len;
+	char *find_query;
+	int find_query_len;
+	int *find_lines;
+	int find_count;
+	int find_cap;
+	int find_origin;
+	int find_scanned;
+	int find_pos;
+	int find_line;
+	int find_active;
+	struct find_part *find_parts;
+	int find_part_count;
+	int find_part_cap;
+	struct find_batch *find_batches;
+	int find_batch_count;
+	int find_batch_cap;
+	int find_next;
+	int find_cancel;
+	int find_found;
+	int find_total;
+	int find_workers;
+	int find_busy;
+	int find_gen;
+	int find_running;
+	int *find_source;
+	int find_source_count;
+	pthread_mutex_t find_lock;
+	pthread_cond_t find_cond;
+	pthread_cond_t find_idle;
+	int *find_index;
+	int find_index_count;
+	int find_index_cap;
+	int find_merged;
+	struct needle needle;
+	int find_regex;
+	struct regex regex;
+	struct dfa find_dfa;
+	const char *find_error;
+	unsigned char char_class[256];
+	int (*scan)(const char *s, int len, int *tabs);
+	int (*search)(struct needle *nd, const char *s, int len, int *hits, int max);
+	struct cell *screen;
+	struct cell *shadow;
+	int shadow_valid;
+	int shadow_rowoff, shadow_coloff;
+	int term_x, term_y;
+	int term_attr;
+	struct sgr_seq sgr[3][CELL_REVERSE];
+	struct abuf frame;
+	char input[KILO_INPUT_SIZE];
+	unsigned int input_head, input_tail;
+	int keys[KILO_KEY_QUEUE];
+	unsigned int key_head, key_tail;
+	struct abuf paste;
+	int pasting;
+	int signal_fd;
+	int timer_fd;
+	int hl_event;
+	long long frame_time;
+	int frame_rate;
 	struct termios orig_termios;
 };
 
@@ -136,7 +496,8 @@ struct editor_syntax HLDB[] = {
 		"//",
 		"/*",
 		"*/",
-		HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+		HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+		NULL
 	},
 };
 
@@ -146,7 +507,11 @@ struct editor_syntax HLDB[] = {
 
 void editor_set_status_message(const char *fmt, ...);
 void editor_refresh_screen();
-char *editor_prompt(char *prompt, void (*callback)(char *, int));
+void editor_resize();
+char *editor_prompt(char *prompt, void (*callback)(char *, int), int allow_empty);
+void *editor_reserve(void *buf, int *cap, int need);
+void ab_append(struct abuf *ab, const char *s, int len);
+void editor_find_stop();
 
 /* terminal */
 
@@ -166,6 +531,7 @@ void die_last(const char *s) {
 }
 
 void disable_raw_mode() {
+	write(STDOUT_FILENO, "\x1b[?2004l", 8);
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &e.orig_termios) == -1)
 		die_last("tcsetattr");
 }
@@ -183,78 +549,253 @@ void enable_raw_mode() {
 	raw.c_cc[VTIME] = 1;
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
 		die_cur("tcsetattr");
+	write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
-int editor_read_key() {
-	int nread;
-	char c;
-	while ((nread = read(STDIN_FILENO, &c, 1)) != 1)
-		if (nread == -1 && errno != EAGAIN)
-			die_last("read");
-	if (c == '\x1b') {
-		char seq[3];
-		if (read(STDIN_FILENO, &seq[0], 1) != 1)
-			return '\x1b';
-		if (read(STDIN_FILENO, &seq[1], 1) != 1)
-			return '\x1b';
-		if (seq[0] == '[') {
-			if (seq[1] >= '0' && seq[1] <= '9') {
-				if (read(STDIN_FILENO, &seq[2], 1) != 1)
-					return '\x1b';
-				if (seq[2] == '~')
-					switch (seq[1]) {
-						case '1':
-							return HOME_KEY;
-
-						case '3':
-							return DEL_KEY;
-
-						case '4':
-							return END_KEY;
-
-						case '5':
-							return PAGE_UP;
-
-						case '6':
-							return PAGE_DOWN;
-
-						case '7':
-							return HOME_KEY;
-
-						case '8':
-							return END_KEY;
-					}
-			} else
+int editor_input_fill() {
+	unsigned int room = KILO_INPUT_SIZE - (e.input_tail - e.input_head);
+	unsigned int at = e.input_tail % KILO_INPUT_SIZE;
+	unsigned int n = KILO_INPUT_SIZE - at;
+	if (n > room)
+		n = room;
+	int nread = read(STDIN_FILENO, &e.input[at], n);
+	if (nread > 0)
+		e.input_tail += nread;
+	return nread;
+}
+
+int editor_input_byte(unsigned int i) {
+	return e.input[(e.input_head + i) % KILO_INPUT_SIZE];
+}
+
+int editor_parse_key(int *key, int flush) {
+	unsigned int avail = e.input_tail - e.input_head;
+	if (avail == 0)
+		return 0;
+	*key = editor_input_byte(0);
+	if (*key != '\x1b')
+		return 1;
+	if (avail < 3)
+		return flush ? avail : 0;
+	char seq[3];
+	seq[0] = editor_input_byte(1);
+	seq[1] = editor_input_byte(2);
+	if (seq[0] == '[') {
+		if (seq[1] >= '0' && seq[1] <= '9') {
+			if (avail < 4)
+				return flush ? avail : 0;
+			seq[2] = editor_input_byte(3);
+			if (seq[2] == '~')
 				switch (seq[1]) {
-					case 'A':
-						return ARROW_UP;
+					case '1':
+						*key = HOME_KEY;
+						break;
 
-					case 'B':
-						return ARROW_DOWN;
+					case '3':
+						*key = DEL_KEY;
+						break;
 
-					case 'C':
-						return ARROW_RIGHT;
+					case '4':
+						*key = END_KEY;
+						break;
 
-					case 'D':
-						return ARROW_LEFT;
+					case '5':
+						*key = PAGE_UP;
+						break;
 
-					case 'H':
-						return HOME_KEY;
+					case '6':
+						*key = PAGE_DOWN;
+						break;
 
-					case 'F':
-						return END_KEY;
+					case '7':
+						*key = HOME_KEY;
+						break;
+
+					case '8':
+						*key = END_KEY;
+						break;
 				}
-		} else if (seq[0] == 'O')
+			return 4;
+		} else
 			switch (seq[1]) {
+				case 'A':
+					*key = ARROW_UP;
+					break;
+
+				case 'B':
+					*key = ARROW_DOWN;
+					break;
+
+				case 'C':
+					*key = ARROW_RIGHT;
+					break;
+
+				case 'D':
+					*key = ARROW_LEFT;
+					break;
+
 				case 'H':
-					return HOME_KEY;
+					*key = HOME_KEY;
+					break;
 
 				case 'F':
-					return END_KEY;
+					*key = END_KEY;
+					break;
 			}
-		return '\x1b';
-	} else
-		return c;
+	} else if (seq[0] == 'O')
+		switch (seq[1]) {
+			case 'H':
+				*key = HOME_KEY;
+				break;
+
+			case 'F':
+				*key = END_KEY;
+				break;
+		}
+	return 3;
+}
+
+int editor_input_match(const char *s, unsigned int len) {
+	unsigned int avail = e.input_tail - e.input_head;
+	for (unsigned int i = 0; i < len; i++) {
+		if (i >= avail)
+			return -1;
+		if (editor_input_byte(i) != s[i])
+			return 0;
+	}
+	return 1;
+}
+
+int editor_input_paste(int flush) {
+	while (e.input_head != e.input_tail) {
+		char c = editor_input_byte(0);
+		if (c == '\x1b') {
+			int end = editor_input_match("\x1b[201~", 6);
+			if (end == 1) {
+				e.input_head += 6;
+				return 1;
+			}
+			if (end == -1 && !flush)
+				return 0;
+		}
+		ab_append(&e.paste, &c, 1);
+		e.input_head++;
+	}
+	return 0;
+}
+
+void editor_input_parse(int flush) {
+	int key, n;
+	while (e.key_tail - e.key_head < KILO_KEY_QUEUE) {
+		if (e.pasting) {
+			if (!editor_input_paste(flush))
+				break;
+			e.pasting = 0;
+			e.keys[e.key_tail++ % KILO_KEY_QUEUE] = PASTE_KEY;
+			break;
+		}
+		int start = editor_input_match("\x1b[200~", 6);
+		if (start == -1 && !flush)
+			break;
+		if (start == 1) {
+			e.input_head += 6;
+			e.pasting = 1;
+			e.paste.len = 0;
+			continue;
+		}
+		if (!(n = editor_parse_key(&key, flush)))
+			break;
+		e.input_head += n;
+		e.keys[e.key_tail++ % KILO_KEY_QUEUE] = key;
+	}
+}
+
+void editor_open_events() {
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGWINCH);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+		die_cur("sigprocmask");
+	if ((e.signal_fd = signalfd(-1, &mask, SFD_CLOEXEC)) == -1)
+		die_cur("signalfd");
+	if ((e.timer_fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC)) == -1)
+		die_cur("timerfd_create");
+	if ((e.hl_event = eventfd(0, EFD_CLOEXEC)) == -1)
+		die_cur("eventfd");
+}
+
+void editor_wait_events() {
+	struct pollfd fds[4] = {
+		{STDIN_FILENO, POLLIN, 0},
+		{e.signal_fd, POLLIN, 0},
+		{e.timer_fd, POLLIN, 0},
+		{e.hl_event, POLLIN, 0}
+	};
+	int timeout = (e.input_head != e.input_tail) ? KILO_ESC_TIMEOUT : -1;
+	pthread_mutex_unlock(&e.lock);
+	int ready = poll(fds, 4, timeout);
+	pthread_mutex_lock(&e.lock);
+	if (ready == -1) {
+		if (errno != EINTR)
+			die_last("poll");
+		return;
+	}
+	if (ready == 0) {
+		editor_input_parse(1);
+		return;
+	}
+	if (fds[0].revents) {
+		int nread = editor_input_fill();
+		if (nread == -1 && errno != EAGAIN)
+			die_last("read");
+		if (nread == 0 && (fds[0].revents & POLLHUP))
+			exit(1);
+		editor_input_parse(0);
+	}
+	int redraw = 0;
+	if (fds[1].revents) {
+		struct signalfd_siginfo info;
+		if (read(e.signal_fd, &info, sizeof(info)) == sizeof(info)) {
+			editor_resize();
+			redraw = 1;
+		}
+	}
+	uint64_t count;
+	if (fds[2].revents && read(e.timer_fd, &count, sizeof(count)) == sizeof(count))
+		redraw = 1;
+	if (fds[3].revents && read(e.hl_event, &count, sizeof(count)) == sizeof(count))
+		redraw |= e.hl_redraw | e.find_active;
+	if (redraw && e.key_head == e.key_tail)
+		editor_refresh_screen();
+}
+
+int editor_read_key() {
+	if (e.key_head == e.key_tail)
+		editor_input_parse(0);
+	while (e.key_head == e.key_tail)
+		editor_wait_events();
+	return e.keys[e.key_head++ % KILO_KEY_QUEUE];
+}
+
+long long editor_clock_ms() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+int editor_input_pending() {
+	if (e.key_head == e.key_tail)
+		editor_input_parse(0);
+	if (e.key_head != e.key_tail)
+		return 1;
+	long long wait = e.frame_time + 1000 / e.frame_rate - editor_clock_ms();
+	struct pollfd fd = {STDIN_FILENO, POLLIN, 0};
+	pthread_mutex_unlock(&e.lock);
+	int ready = poll(&fd, 1, wait > 0 ? wait : 0);
+	pthread_mutex_lock(&e.lock);
+	if (ready > 0 && editor_input_fill() > 0)
+		editor_input_parse(0);
+	return e.key_head != e.key_tail;
 }
 
 int get_cursor_position(int *rows, int *cols) {
@@ -290,257 +831,2556 @@ int get_window_size(int *rows, int *cols) {
 	}
 }
 
-/* syntax highlighting */
+/* byte scan */
 
-int is_separator(int c) {
-	return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+int editor_scan_tail(const char *s, int len, int *tabs, int flags) {
+	for (int i = 0; i < len; i++) {
+		unsigned char c = s[i];
+		if (c == '\t') {
+			flags |= SCAN_TAB;
+			if (tabs)
+				(*tabs)++;
+		} else if (c < 0x20 || c == 0x7F)
+			flags |= SCAN_CTRL;
+		else if (c >= 0x80)
+			flags |= SCAN_HIGH;
+	}
+	return flags;
 }
 
-void editor_update_syntax(erow *row) {
-	row->hl = realloc(row->hl, row->rsize);
-	memset(row->hl, HL_NORMAL, row->rsize);
-	if (e.syntax == NULL)
-		return;
-	char **keywords = e.syntax->keywords;
-	char *scs = e.syntax->singleline_comment_start;
-	char *mcs = e.syntax->multiline_comment_start;
-	char *mce = e.syntax->multiline_comment_end;
-	int scs_len = scs ? strlen(scs) : 0;
-	int mcs_len = mcs ? strlen(mcs) : 0;
-	int mce_len = mce ? strlen(mce) : 0;
-	int prev_sep = 1;
-	int in_string = 0;
-	int in_comment = (row->idx > 0 && e.row[row->idx - 1].hl_open_comment);
+int editor_scan_scalar(const char *s, int len, int *tabs) {
+	if (tabs)
+		*tabs = 0;
+	return editor_scan_tail(s, len, tabs, 0);
+}
+
+#ifdef __SSE2__
+int editor_scan_sse2(const char *s, int len, int *tabs) {
+	__m128i tab = _mm_set1_epi8('\t');
+	__m128i space = _mm_set1_epi8(0x20);
+	__m128i del = _mm_set1_epi8(0x7F);
+	int count = 0, flags = 0;
 	int i = 0;
-	while (i < row->rsize) {
-		char c = row->render[i];
-		unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
-		if (scs_len && !in_string && !in_comment)
-			if (!strncmp(&row->render[i], scs, scs_len)) {
-				memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-				break;
-			}
-		if (mcs_len && mce_len && !in_string) {
-			if (in_comment) {
-				row->hl[i] = HL_MLCOMMENT;
-				if (!strncmp(&row->render[i], mce, mce_len)) {
-					memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-					i += mce_len;
-					in_comment = 0;
-					prev_sep = 1;
-					continue;
-				} else {
-					i++;
-					continue;
-				}
-			} else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-				memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-				i += mcs_len;
-				in_comment = 1;
-				continue;
-			}
-		}
-		if (e.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-			if (in_string) {
-				row->hl[i] = HL_STRING;
-				if (c == '\\' && i + 1 < row->rsize) {
-					row->hl[i + 1] = HL_STRING;
-					i += 2;
-					continue;
-				}
-				if (c == in_string)
-					in_string = 0;
-				i++;
-				prev_sep = 1;
-				continue;
-			} else if (c == '"' || c == '\'') {
-				in_string = c;
-				row->hl[i] = HL_STRING;
-				i++;
-				continue;
-			}
-		}
-		if (e.syntax->flags & HL_HIGHLIGHT_NUMBERS)
-			if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) || (c == '.' && prev_hl == HL_NUMBER)) {
-				row->hl[i] = HL_NUMBER;
-				i++;
-				prev_sep = 0;
-				continue;
-			}
-		if (prev_sep) {
-			int j;
-			for (j = 0; keywords[j]; j++) {
-				int klen = strlen(keywords[j]);
-				int kw2 = keywords[j][klen - 1] == '|';
-				if (kw2)
-					klen--;
-				if (!strncmp(&row->render[i], keywords[j], klen) && is_separator(row->render[i + klen])) {
-					memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-					i += klen;
-					break;
-				}
-			}
-			if (keywords[j] != NULL) {
-				prev_sep = 0;
-				continue;
-			}
-		}
-		prev_sep = is_separator(c);
-		i++;
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&s[i]);
+		int t = _mm_movemask_epi8(_mm_cmpeq_epi8(v, tab));
+		int high = _mm_movemask_epi8(v);
+		int low = _mm_movemask_epi8(_mm_cmplt_epi8(v, space)) & ~high;
+		int ctrl = (low & ~t) | _mm_movemask_epi8(_mm_cmpeq_epi8(v, del));
+		count += __builtin_popcount(t);
+		flags |= (t ? SCAN_TAB : 0) | (ctrl ? SCAN_CTRL : 0) | (high ? SCAN_HIGH : 0);
 	}
-	int changed = (row->hl_open_comment != in_comment);
-	row->hl_open_comment = in_comment;
-	if (changed && row->idx + 1 < e.numrows)
-		editor_update_syntax(&e.row[row->idx + 1]);
+	if (tabs)
+		*tabs = count;
+	return editor_scan_tail(&s[i], len - i, tabs, flags);
 }
+#endif
 
-int editor_syntax_to_color(int hl) {
-	switch (hl) {
-		case HL_COMMENT:
-		case HL_MLCOMMENT:
-			return 36;
+#ifdef KILO_AVX2
+__attribute__((target("avx2"))) int editor_scan_avx2(const char *s, int len, int *tabs) {
+	__m256i tab = _mm256_set1_epi8('\t');
+	__m256i space = _mm256_set1_epi8(0x20);
+	__m256i del = _mm256_set1_epi8(0x7F);
+	int count = 0, flags = 0;
+	int i = 0;
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)&s[i]);
+		unsigned int t = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, tab));
+		unsigned int high = _mm256_movemask_epi8(v);
+		unsigned int low = _mm256_movemask_epi8(_mm256_cmpgt_epi8(space, v)) & ~high;
+		unsigned int ctrl = (low & ~t) | _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, del));
+		count += __builtin_popcount(t);
+		flags |= (t ? SCAN_TAB : 0) | (ctrl ? SCAN_CTRL : 0) | (high ? SCAN_HIGH : 0);
+	}
+	if (tabs)
+		*tabs = count;
+	return editor_scan_tail(&s[i], len - i, tabs, flags);
+}
+#endif
 
-		case HL_KEYWORD1:
-			return 33;
+void editor_select_scan() {
+	e.scan = editor_scan_scalar;
+#ifdef __SSE2__
+	e.scan = editor_scan_sse2;
+#endif
+#ifdef KILO_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		e.scan = editor_scan_avx2;
+#endif
+}
 
-		case HL_KEYWORD2:
-			return 32;
+/* utf-8 */
 
-		case HL_STRING:
-			return 35;
+int WIDTH_ZERO[][2] = {
+	{0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x064B, 0x065F},
+	{0x200B, 0x200F}, {0x202A, 0x202E}, {0x2060, 0x2064}, {0x20D0, 0x20FF},
+	{0xFE00, 0xFE0F}, {0xFE20, 0xFE2F}, {0xFEFF, 0xFEFF}
+};
 
-		case HL_NUMBER:
-			return 31;
+int WIDTH_WIDE[][2] = {
+	{0x1100, 0x115F}, {0x2E80, 0x303E}, {0x3041, 0x33FF}, {0x3400, 0x4DBF},
+	{0x4E00, 0x9FFF}, {0xA000, 0xA4CF}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF},
+	{0xFE30, 0xFE4F}, {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6}, {0x1F300, 0x1F64F},
+	{0x1F900, 0x1F9FF}, {0x20000, 0x3FFFD}
+};
 
-		case HL_MATCH:
-			return 34;
+int editor_char_width(int cp) {
+	if (cp < 0x300)
+		return 1;
+	for (size_t k = 0; k < sizeof(WIDTH_ZERO) / sizeof(WIDTH_ZERO[0]); k++)
+		if (cp >= WIDTH_ZERO[k][0] && cp <= WIDTH_ZERO[k][1])
+			return 0;
+	for (size_t k = 0; k < sizeof(WIDTH_WIDE) / sizeof(WIDTH_WIDE[0]); k++)
+		if (cp >= WIDTH_WIDE[k][0] && cp <= WIDTH_WIDE[k][1])
+			return 2;
+	return 1;
+}
 
-		default:
-			return 37;
+int editor_utf8_decode(const char *s, int len, int *cp) {
+	const unsigned char *u = (const unsigned char *)s;
+	int n;
+	if (u[0] < 0x80) {
+		*cp = u[0];
+		return 1;
+	}
+	if (u[0] >= 0xC2 && u[0] <= 0xDF) {
+		n = 2;
+		*cp = u[0] & 0x1F;
+	} else if (u[0] >= 0xE0 && u[0] <= 0xEF) {
+		n = 3;
+		*cp = u[0] & 0x0F;
+	} else if (u[0] >= 0xF0 && u[0] <= 0xF4) {
+		n = 4;
+		*cp = u[0] & 0x07;
+	} else {
+		*cp = -1;
+		return 1;
+	}
+	if (len < n) {
+		*cp = -1;
+		return 1;
+	}
+	for (int k = 1; k < n; k++) {
+		if ((u[k] & 0xC0) != 0x80) {
+			*cp = -1;
+			return 1;
+		}
+		*cp = (*cp << 6) | (u[k] & 0x3F);
+	}
+	if ((n == 3 && (*cp < 0x800 || (*cp >= 0xD800 && *cp <= 0xDFFF))) || (n == 4 && (*cp < 0x10000 || *cp > 0x10FFFF))) {
+		*cp = -1;
+		return 1;
 	}
+	return n;
 }
 
-void editor_select_syntax_highlight() {
-	e.syntax = NULL;
-	if (e.filename == NULL)
-		return;
-	char *ext = strrchr(e.filename, '.');
-	for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-		struct editor_syntax *s = &HLDB[j];
-		unsigned int i = 0;
-		while (s->filematch[i]) {
-			int is_ext = (s->filematch[i][0] == '.');
-			if ((is_ext && ext && !strcmp(ext, s->filematch[i])) || (!is_ext && strstr(e.filename, s->filematch[i]))) {
-				e.syntax = s;
-				int filerow;
-				for (filerow = 0; filerow < e.numrows; filerow++)
-					editor_update_syntax(&e.row[filerow]);
-				return;
-			}
-			i++;
+int editor_utf8_start(const char *s, int len, int at) {
+	if (at >= len || ((unsigned char)s[at] & 0xC0) != 0x80)
+		return at;
+	for (int p = at - 1; p >= 0 && p >= at - 3; p--)
+		if (((unsigned char)s[p] & 0xC0) != 0x80) {
+			int cp;
+			return (p + editor_utf8_decode(&s[p], len - p, &cp) > at) ? p : at;
 		}
+	return at;
+}
+
+int editor_utf8_encode(int cp, char *out) {
+	if (cp < 0x80) {
+		out[0] = cp;
+		return 1;
+	}
+	if (cp < 0x800) {
+		out[0] = 0xC0 | (cp >> 6);
+		out[1] = 0x80 | (cp & 0x3F);
+		return 2;
 	}
+	if (cp < 0x10000) {
+		out[0] = 0xE0 | (cp >> 12);
+		out[1] = 0x80 | ((cp >> 6) & 0x3F);
+		out[2] = 0x80 | (cp & 0x3F);
+		return 3;
+	}
+	out[0] = 0xF0 | (cp >> 18);
+	out[1] = 0x80 | ((cp >> 12) & 0x3F);
+	out[2] = 0x80 | ((cp >> 6) & 0x3F);
+	out[3] = 0x80 | (cp & 0x3F);
+	return 4;
 }
 
-/* row operations */
+int editor_is_ascii(const char *s, int len) {
+	return !(e.scan(s, len, NULL) & SCAN_HIGH);
+}
 
-int editor_row_cx_to_rx(erow *row, int cx) {
-	int rx = 0;
-	int j;
-	for (j = 0; j < cx; j++) {
-		if (row->chars[j] == '\t')
-			rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
-		rx++;
+int editor_utf8_partial(const char *s, int len) {
+	for (int k = 1; k <= 3 && k <= len; k++) {
+		unsigned char c = s[len - k];
+		if ((c & 0xC0) != 0x80)
+			return c >= 0xC0 && k < (c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : 2);
+	}
+	return 0;
+}
+
+/* substring search */
+
+int editor_case_map(const unsigned char *s, int len, unsigned char *out, int upper) {
+	unsigned char c = s[0];
+	if ((c == 0xD0 || c == 0xD1) && len > 1 && (s[1] & 0xC0) == 0x80) {
+		int cp = ((c & 0x1F) << 6) | (s[1] & 0x3F);
+		if (upper && cp >= 0x430 && cp <= 0x44F)
+			cp -= 0x20;
+		else if (upper && cp >= 0x450 && cp <= 0x45F)
+			cp -= 0x50;
+		else if (!upper && cp >= 0x410 && cp <= 0x42F)
+			cp += 0x20;
+		else if (!upper && cp <= 0x40F)
+			cp += 0x50;
+		out[0] = 0xC0 | (cp >> 6);
+		out[1] = 0x80 | (cp & 0x3F);
+		return 2;
+	}
+	out[0] = (c < 0x80) ? (upper ? toupper(c) : tolower(c)) : c;
+	return 1;
+}
+
+void editor_needle_compile(struct needle *nd, const char *query, int len) {
+	const unsigned char *q = (const unsigned char *)query;
+	unsigned char *upper = malloc(len + 1);
+	nd->s = realloc(nd->s, len + 1);
+	nd->len = len;
+	for (int j = 0; j < len; ) {
+		editor_case_map(&q[j], len - j, &upper[j], 1);
+		j += editor_case_map(&q[j], len - j, &nd->s[j], 0);
+	}
+	nd->fold = !memcmp(nd->s, q, len);
+	if (!nd->fold) {
+		memcpy(nd->s, q, len);
+		memcpy(upper, q, len);
+	}
+	nd->anchor = (len > 1 && q[0] >= 0xC0) ? 1 : 0;
+	nd->first[0] = nd->s[nd->anchor];
+	nd->first[1] = upper[nd->anchor];
+	nd->last[0] = nd->s[len - 1];
+	nd->last[1] = upper[len - 1];
+	free(upper);
+}
+
+int editor_needle_equal(struct needle *nd, const unsigned char *s) {
+	if (!memcmp(s, nd->s, nd->len))
+		return 1;
+	if (!nd->fold)
+		return 0;
+	unsigned char c[2];
+	for (int j = 0; j < nd->len; ) {
+		if (s[j] < 0x80) {
+			if ((s[j] >= 'A' && s[j] <= 'Z' ? s[j] | 0x20 : s[j]) != nd->s[j])
+				return 0;
+			j++;
+			continue;
+		}
+		int k = editor_case_map(&s[j], nd->len - j, c, 0);
+		if (c[0] != nd->s[j] || (k == 2 && c[1] != nd->s[j + 1]))
+			return 0;
+		j += k;
+	}
+	return 1;
+}
+
+int editor_search_tail(struct needle *nd, const char *s, int len, int i, int *hits, int found, int max) {
+	const unsigned char *u = (const unsigned char *)s;
+	for (; i + nd->len <= len && found < max; i++) {
+		unsigned char a = u[i + nd->anchor], b = u[i + nd->len - 1];
+		if ((a == nd->first[0] || a == nd->first[1]) && (b == nd->last[0] || b == nd->last[1]) && editor_needle_equal(nd, &u[i]))
+			hits[found++] = i;
+	}
+	return found;
+}
+
+int editor_search_scalar(struct needle *nd, const char *s, int len, int *hits, int max) {
+	return editor_search_tail(nd, s, len, 0, hits, 0, max);
+}
+
+#ifdef __SSE2__
+int editor_search_sse2(struct needle *nd, const char *s, int len, int *hits, int max) {
+	__m128i f0 = _mm_set1_epi8(nd->first[0]), f1 = _mm_set1_epi8(nd->first[1]);
+	__m128i l0 = _mm_set1_epi8(nd->last[0]), l1 = _mm_set1_epi8(nd->last[1]);
+	int found = 0;
+	int i = 0;
+	for (; i + nd->len + 15 <= len; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)&s[i + nd->anchor]);
+		__m128i b = _mm_loadu_si128((const __m128i *)&s[i + nd->len - 1]);
+		__m128i fa = _mm_or_si128(_mm_cmpeq_epi8(a, f0), _mm_cmpeq_epi8(a, f1));
+		__m128i lb = _mm_or_si128(_mm_cmpeq_epi8(b, l0), _mm_cmpeq_epi8(b, l1));
+		unsigned int mask = _mm_movemask_epi8(_mm_and_si128(fa, lb));
+		for (; mask; mask &= mask - 1) {
+			int at = i + __builtin_ctz(mask);
+			if (editor_needle_equal(nd, (const unsigned char *)&s[at])) {
+				hits[found++] = at;
+				if (found == max)
+					return found;
+			}
+		}
+	}
+	return editor_search_tail(nd, s, len, i, hits, found, max);
+}
+#endif
+
+#ifdef KILO_AVX2
+__attribute__((target("avx2"))) int editor_search_avx2(struct needle *nd, const char *s, int len, int *hits, int max) {
+	__m256i f0 = _mm256_set1_epi8(nd->first[0]), f1 = _mm256_set1_epi8(nd->first[1]);
+	__m256i l0 = _mm256_set1_epi8(nd->last[0]), l1 = _mm256_set1_epi8(nd->last[1]);
+	int found = 0;
+	int i = 0;
+	for (; i + nd->len + 31 <= len; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)&s[i + nd->anchor]);
+		__m256i b = _mm256_loadu_si256((const __m256i *)&s[i + nd->len - 1]);
+		__m256i fa = _mm256_or_si256(_mm256_cmpeq_epi8(a, f0), _mm256_cmpeq_epi8(a, f1));
+		__m256i lb = _mm256_or_si256(_mm256_cmpeq_epi8(b, l0), _mm256_cmpeq_epi8(b, l1));
+		unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(fa, lb));
+		for (; mask; mask &= mask - 1) {
+			int at = i + __builtin_ctz(mask);
+			if (editor_needle_equal(nd, (const unsigned char *)&s[at])) {
+				hits[found++] = at;
+				if (found == max)
+					return found;
+			}
+		}
+	}
+	return editor_search_tail(nd, s, len, i, hits, found, max);
+}
+#endif
+
+void editor_select_search() {
+	e.search = editor_search_scalar;
+#ifdef __SSE2__
+	e.search = editor_search_sse2;
+#endif
+#ifdef KILO_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		e.search = editor_search_avx2;
+#endif
+}
+
+/* regex */
+
+int RE_DOT[][2] = {{0, '\n' - 1}, {'\n' + 1, 0x10FFFF}};
+int RE_DIGIT[][2] = {{'0', '9'}};
+int RE_SPACE[][2] = {{'\t', '\r'}, {' ', ' '}};
+int RE_WORD[][2] = {{'0', '9'}, {'A', 'Z'}, {'_', '_'}, {'a', 'z'}, {0xC0, 0x53F}, {0x3000, 0x10FFFF}};
+
+int editor_re_word(unsigned char c) {
+	if (c < 0x80)
+		return isalnum(c) || c == '_';
+	return (c >= 0xC3 && c <= 0xD4) || c >= 0xE3;
+}
+
+int editor_re_flags(int flags, unsigned char c) {
+	if ((c & 0xC0) == 0x80)
+		return flags & DFA_WORD;
+	return editor_re_word(c) ? DFA_WORD : 0;
+}
+
+int editor_re_assert(int op, int flags, int next) {
+	int word = (flags & DFA_WORD) != 0;
+	int ahead = next < 0 ? 0 : (next & 0xC0) == 0x80 ? word : editor_re_word(next);
+	switch (op) {
+		case RE_BOL:
+			return flags & DFA_BOL;
+		case RE_EOL:
+			return next < 0;
+		case RE_WORDB:
+			return word != ahead;
+		default:
+			return word == ahead;
+	}
+}
+
+int editor_re_node(struct re_parser *p, int kind, int a, int b) {
+	if (p->node_count == p->node_cap) {
+		p->node_cap = p->node_cap ? p->node_cap * 2 : 64;
+		p->nodes = realloc(p->nodes, sizeof(struct re_node) * p->node_cap);
+	}
+	struct re_node *n = &p->nodes[p->node_count];
+	n->kind = kind;
+	n->a = a;
+	n->b = b;
+	n->min = n->max = 0;
+	return p->node_count++;
+}
+
+void editor_re_range(struct re_parser *p, int lo, int hi) {
+	if (p->range_count == p->range_cap) {
+		p->range_cap = p->range_cap ? p->range_cap * 2 : 64;
+		p->ranges = realloc(p->ranges, sizeof(p->ranges[0]) * p->range_cap);
+	}
+	p->ranges[p->range_count][0] = lo;
+	p->ranges[p->range_count][1] = hi;
+	p->range_count++;
+}
+
+void editor_re_table(struct re_parser *p, int (*table)[2], int n, int negate) {
+	int lo = 0;
+	for (int k = 0; k < n; k++) {
+		if (!negate)
+			editor_re_range(p, table[k][0], table[k][1]);
+		else if (table[k][0] > lo)
+			editor_re_range(p, lo, table[k][0] - 1);
+		lo = table[k][1] + 1;
+	}
+	if (negate && lo <= 0x10FFFF)
+		editor_re_range(p, lo, 0x10FFFF);
+}
+
+int editor_re_escape(struct re_parser *p, int c) {
+	switch (c) {
+		case 'd':
+		case 'D':
+			editor_re_table(p, RE_DIGIT, 1, c == 'D');
+			return 1;
+		case 's':
+		case 'S':
+			editor_re_table(p, RE_SPACE, 2, c == 'S');
+			return 1;
+		case 'w':
+		case 'W':
+			editor_re_table(p, RE_WORD, 6, c == 'W');
+			return 1;
+	}
+	return 0;
+}
+
+int editor_re_char(struct re_parser *p) {
+	int escape = p->s[p->pos] == '\\' && p->pos + 1 < p->len;
+	int cp;
+	p->pos += escape;
+	p->pos += editor_utf8_decode((const char *)&p->s[p->pos], p->len - p->pos, &cp);
+	if (cp < 0)
+		cp = p->s[p->pos - 1];
+	if (escape && (cp == 't' || cp == 'n' || cp == 'r'))
+		cp = cp == 't' ? '\t' : cp == 'n' ? '\n' : '\r';
+	return cp;
+}
+
+int editor_re_class(struct re_parser *p) {
+	int first = p->range_count;
+	int negate = p->pos < p->len && p->s[p->pos] == '^';
+	p->pos += negate;
+	int start = p->pos;
+	while (p->pos < p->len && (p->s[p->pos] != ']' || p->pos == start)) {
+		if (p->s[p->pos] == '\\' && p->pos + 1 < p->len && editor_re_escape(p, p->s[p->pos + 1])) {
+			p->pos += 2;
+			continue;
+		}
+		int lo = editor_re_char(p), hi = lo;
+		if (p->pos + 1 < p->len && p->s[p->pos] == '-' && p->s[p->pos + 1] != ']') {
+			p->pos++;
+			hi = editor_re_char(p);
+		}
+		if (hi < lo) {
+			p->error = "bad range";
+			return -1;
+		}
+		editor_re_range(p, lo, hi);
+	}
+	if (p->pos == p->len) {
+		p->error = "missing ]";
+		return -1;
+	}
+	p->pos++;
+	int node = editor_re_node(p, RN_CLASS, first, p->range_count - first);
+	p->nodes[node].min = negate;
+	return node;
+}
+
+int editor_re_alt(struct re_parser *p);
+
+int editor_re_atom(struct re_parser *p) {
+	int first = p->range_count;
+	int c = p->s[p->pos], cp;
+	switch (c) {
+		case '(':
+			p->pos++;
+			int node = editor_re_alt(p);
+			if (node < 0)
+				return -1;
+			if (p->pos == p->len) {
+				p->error = "missing )";
+				return -1;
+			}
+			p->pos++;
+			return node;
+		case '[':
+			p->pos++;
+			return editor_re_class(p);
+		case '.':
+			p->pos++;
+			editor_re_table(p, RE_DOT, 2, 0);
+			return editor_re_node(p, RN_CLASS, first, p->range_count - first);
+		case '^':
+		case '$':
+			p->pos++;
+			return editor_re_node(p, RN_ASSERT, c == '^' ? RE_BOL : RE_EOL, 0);
+		case '*':
+		case '+':
+		case '?':
+		case '{':
+			p->error = "nothing to repeat";
+			return -1;
+		case '\\':
+			if (p->pos + 1 == p->len)
+				break;
+			c = p->s[p->pos + 1];
+			if (c == 'b' || c == 'B') {
+				p->pos += 2;
+				return editor_re_node(p, RN_ASSERT, c == 'b' ? RE_WORDB : RE_NWORDB, 0);
+			}
+			if (editor_re_escape(p, c)) {
+				p->pos += 2;
+				return editor_re_node(p, RN_CLASS, first, p->range_count - first);
+			}
+			break;
+		default:
+			if (c >= 0x80 && (editor_utf8_decode((const char *)&p->s[p->pos], p->len - p->pos, &cp), cp < 0)) {
+				p->pos++;
+				return editor_re_node(p, RN_BYTE, c, 0);
+			}
+	}
+	c = editor_re_char(p);
+	editor_re_range(p, c, c);
+	return editor_re_node(p, RN_CLASS, first, 1);
+}
+
+int editor_re_number(struct re_parser *p) {
+	int n = -1;
+	while (p->pos < p->len && isdigit(p->s[p->pos]) && n <= KILO_RE_REPEAT)
+		n = (n < 0 ? 0 : n * 10) + (p->s[p->pos++] - '0');
+	return n;
+}
+
+int editor_re_repeat(struct re_parser *p) {
+	int node = editor_re_atom(p);
+	while (node >= 0 && p->pos < p->len) {
+		int c = p->s[p->pos], min, max;
+		if (c == '*' || c == '+' || c == '?') {
+			p->pos++;
+			min = c == '+';
+			max = c == '?' ? 1 : -1;
+		} else if (c == '{') {
+			p->pos++;
+			min = max = editor_re_number(p);
+			if (p->pos < p->len && p->s[p->pos] == ',') {
+				p->pos++;
+				max = editor_re_number(p);
+			}
+			if (min < 0 || p->pos == p->len || p->s[p->pos] != '}' || min > KILO_RE_REPEAT || max > KILO_RE_REPEAT || (max >= 0 && max < min)) {
+				p->error = "bad repeat";
+				return -1;
+			}
+			p->pos++;
+		} else
+			break;
+		node = editor_re_node(p, RN_REPEAT, node, 0);
+		p->nodes[node].min = min;
+		p->nodes[node].max = max;
+	}
+	return node;
+}
+
+int editor_re_cat(struct re_parser *p) {
+	int node = editor_re_node(p, RN_EMPTY, 0, 0);
+	while (p->pos < p->len && p->s[p->pos] != '|' && p->s[p->pos] != ')') {
+		if (p->node_count > KILO_RE_INSTS) {
+			p->error = "pattern too large";
+			return -1;
+		}
+		int next = editor_re_repeat(p);
+		if (next < 0)
+			return -1;
+		node = editor_re_node(p, RN_CAT, node, next);
+	}
+	return node;
+}
+
+int editor_re_alt(struct re_parser *p) {
+	int node = editor_re_cat(p);
+	while (node >= 0 && p->pos < p->len && p->s[p->pos] == '|') {
+		p->pos++;
+		int next = editor_re_cat(p);
+		if (next < 0)
+			return -1;
+		node = editor_re_node(p, RN_ALT, node, next);
+	}
+	return node;
+}
+
+int editor_re_emit(struct regex *re, int op, int lo, int hi) {
+	if (re->count == re->cap) {
+		re->cap = re->cap ? re->cap * 2 : 64;
+		re->insts = realloc(re->insts, sizeof(struct re_inst) * re->cap);
+	}
+	struct re_inst *in = &re->insts[re->count];
+	in->op = op;
+	in->lo = lo;
+	in->hi = hi;
+	in->x = in->y = re->count + 1;
+	return re->count++;
+}
+
+void editor_re_utf8(int lo, int hi, unsigned char (*seqs)[9], int *count) {
+	int limits[] = {0x7F, 0x7FF, 0xFFFF};
+	for (int k = 0; k < 3; k++)
+		if (lo <= limits[k] && hi > limits[k]) {
+			editor_re_utf8(lo, limits[k], seqs, count);
+			editor_re_utf8(limits[k] + 1, hi, seqs, count);
+			return;
+		}
+	int n = lo < 0x80 ? 1 : lo < 0x800 ? 2 : lo < 0x10000 ? 3 : 4;
+	for (int k = 1; k < n; k++) {
+		int m = (1 << (6 * k)) - 1;
+		if ((lo & ~m) == (hi & ~m))
+			continue;
+		if (lo & m) {
+			editor_re_utf8(lo, lo | m, seqs, count);
+			editor_re_utf8((lo | m) + 1, hi, seqs, count);
+			return;
+		}
+		if ((hi & m) != m) {
+			editor_re_utf8(lo, (hi & ~m) - 1, seqs, count);
+			editor_re_utf8(hi & ~m, hi, seqs, count);
+			return;
+		}
+	}
+	unsigned char *seq = seqs[(*count)++];
+	seq[0] = n;
+	editor_utf8_encode(lo, (char *)&seq[1]);
+	editor_utf8_encode(hi, (char *)&seq[5]);
+}
+
+int editor_re_compare(const void *a, const void *b) {
+	return *(const int *)a - *(const int *)b;
+}
+
+void editor_re_class_gen(struct re_parser *p, struct regex *re, struct re_node *n) {
+	int (*r)[2] = malloc(sizeof(r[0]) * (n->b + 1));
+	memcpy(r, &p->ranges[n->a], sizeof(r[0]) * n->b);
+	qsort(r, n->b, sizeof(r[0]), editor_re_compare);
+	int count = 0;
+	for (int k = 0; k < n->b; k++) {
+		if (count && r[k][0] <= r[count - 1][1] + 1) {
+			if (r[k][1] > r[count - 1][1])
+				r[count - 1][1] = r[k][1];
+			continue;
+		}
+		r[count][0] = r[k][0];
+		r[count][1] = r[k][1];
+		count++;
+	}
+	if (n->min) {
+		int lo = 0, negated = 0;
+		for (int k = 0; k < count; k++) {
+			int start = r[k][0], next = r[k][1] + 1;
+			if (start > lo) {
+				r[negated][0] = lo;
+				r[negated][1] = start - 1;
+				negated++;
+			}
+			lo = next;
+		}
+		if (lo <= 0x10FFFF) {
+			r[negated][0] = lo;
+			r[negated][1] = 0x10FFFF;
+			negated++;
+		}
+		count = negated;
+	}
+	unsigned char (*seqs)[9] = malloc(sizeof(seqs[0]) * (count * 16 + 1));
+	int *jumps = malloc(sizeof(int) * (count * 16 + 1));
+	int n_seqs = 0;
+	for (int k = 0; k < count; k++)
+		editor_re_utf8(r[k][0], r[k][1], seqs, &n_seqs);
+	if (n_seqs == 0)
+		editor_re_emit(re, RE_RANGE, 1, 0);
+	for (int k = 0; k < n_seqs; k++) {
+		int split = k + 1 < n_seqs ? editor_re_emit(re, RE_SPLIT, 0, 0) : -1;
+		for (int j = 0; j < seqs[k][0]; j++)
+			editor_re_emit(re, RE_RANGE, seqs[k][1 + j], seqs[k][5 + j]);
+		if (split >= 0) {
+			jumps[k] = editor_re_emit(re, RE_JMP, 0, 0);
+			re->insts[split].y = re->count;
+		}
+	}
+	for (int k = 0; k + 1 < n_seqs; k++)
+		re->insts[jumps[k]].x = re->count;
+	free(jumps);
+	free(seqs);
+	free(r);
+}
+
+void editor_re_gen(struct re_parser *p, struct regex *re, int node) {
+	struct re_node *n = &p->nodes[node];
+	if (re->count > KILO_RE_INSTS)
+		return;
+	switch (n->kind) {
+		case RN_CLASS:
+			editor_re_class_gen(p, re, n);
+			break;
+		case RN_BYTE:
+			editor_re_emit(re, RE_RANGE, n->a, n->a);
+			break;
+		case RN_ASSERT:
+			editor_re_emit(re, n->a, 0, 0);
+			break;
+		case RN_CAT:
+			editor_re_gen(p, re, n->a);
+			editor_re_gen(p, re, n->b);
+			break;
+		case RN_ALT: {
+			int split = editor_re_emit(re, RE_SPLIT, 0, 0);
+			editor_re_gen(p, re, n->a);
+			int jump = editor_re_emit(re, RE_JMP, 0, 0);
+			re->insts[split].y = re->count;
+			editor_re_gen(p, re, n->b);
+			re->insts[jump].x = re->count;
+			break;
+		}
+		case RN_REPEAT:
+			for (int k = 0; k < n->min; k++)
+				editor_re_gen(p, re, n->a);
+			if (n->max < 0) {
+				int split = editor_re_emit(re, RE_SPLIT, 0, 0);
+				editor_re_gen(p, re, n->a);
+				int jump = editor_re_emit(re, RE_JMP, 0, 0);
+				re->insts[jump].x = split;
+				re->insts[split].y = re->count;
+				break;
+			}
+			int *splits = malloc(sizeof(int) * (n->max - n->min + 1));
+			int count = 0;
+			for (int k = n->min; k < n->max && re->count <= KILO_RE_INSTS; k++) {
+				splits[count++] = editor_re_emit(re, RE_SPLIT, 0, 0);
+				editor_re_gen(p, re, n->a);
+			}
+			for (int k = 0; k < count; k++)
+				re->insts[splits[k]].y = re->count;
+			free(splits);
+			break;
+	}
+}
+
+const char *editor_regex_compile(struct regex *re, const char *pattern, int len) {
+	struct re_parser p = {(const unsigned char *)pattern, len, 0, NULL, 0, 0, NULL, 0, 0, NULL};
+	re->count = 0;
+	int root = editor_re_alt(&p);
+	if (root >= 0 && p.pos < len)
+		p.error = "unmatched )";
+	if (!p.error) {
+		editor_re_gen(&p, re, root);
+		editor_re_emit(re, RE_MATCH, 0, 0);
+		if (re->count > KILO_RE_INSTS)
+			p.error = "pattern too large";
+	}
+	free(p.nodes);
+	free(p.ranges);
+	if (p.error)
+		re->count = 0;
+	return p.error;
+}
+
+int editor_regex_locate(struct regex *re, const char *s, int len, int from, int *end) {
+	const unsigned char *u = (const unsigned char *)s;
+	int n = re->count;
+	int *buf = calloc(7 * n + 3, sizeof(int));
+	int *kpc = buf, *kstart = kpc + n + 1, *rpc = kstart + n + 1, *rstart = rpc + n, *stack = rstart + n, *mark = stack + 2 * n + 1;
+	int best = -1, gen = 0, kn = 0;
+	int lead = from - 1;
+	while (lead > 0 && lead > from - 4 && (u[lead] & 0xC0) == 0x80)
+		lead--;
+	int flags = from == 0 ? DFA_BOL : editor_re_flags(0, u[lead]);
+	for (int i = from; ; i++) {
+		int c = i < len ? u[i] : -1;
+		if (best < 0 && (c < 0 || (c & 0xC0) != 0x80)) {
+			kpc[kn] = 0;
+			kstart[kn++] = i;
+		}
+		int rn = 0;
+		gen++;
+		for (int k = 0; k < kn; k++) {
+			int top = 0;
+			stack[top++] = kpc[k];
+			while (top) {
+				int pc = stack[--top];
+				if (mark[pc] == gen)
+					continue;
+				mark[pc] = gen;
+				struct re_inst *in = &re->insts[pc];
+				switch (in->op) {
+					case RE_RANGE:
+						rpc[rn] = pc;
+						rstart[rn++] = kstart[k];
+						break;
+					case RE_MATCH:
+						if (best < 0 || kstart[k] < best || (kstart[k] == best && i > *end)) {
+							best = kstart[k];
+							*end = i;
+						}
+						break;
+					case RE_SPLIT:
+						stack[top++] = in->y;
+						stack[top++] = in->x;
+						break;
+					case RE_JMP:
+						stack[top++] = in->x;
+						break;
+					default:
+						if (editor_re_assert(in->op, flags, c))
+							stack[top++] = pc + 1;
+				}
+			}
+		}
+		if (c < 0)
+			break;
+		kn = 0;
+		for (int k = 0; k < rn; k++) {
+			struct re_inst *in = &re->insts[rpc[k]];
+			if ((best < 0 || rstart[k] <= best) && c >= in->lo && c <= in->hi) {
+				kpc[kn] = rpc[k] + 1;
+				kstart[kn++] = rstart[k];
+			}
+		}
+		if (kn == 0 && best >= 0)
+			break;
+		flags = editor_re_flags(flags, c);
+	}
+	free(buf);
+	return best;
+}
+
+void editor_dfa_flush(struct dfa *d) {
+	for (int k = 0; k < d->count; k++)
+		free(d->states[k].pcs);
+	d->count = 0;
+	d->start = -1;
+	memset(d->table, -1, sizeof(int) * KILO_DFA_STATES * 2);
+}
+
+void editor_dfa_init(struct dfa *d, struct regex *re) {
+	int n = re->count;
+	d->re = re;
+	d->states = malloc(sizeof(struct dfa_state) * KILO_DFA_STATES);
+	d->table = malloc(sizeof(int) * KILO_DFA_STATES * 2);
+	d->count = 0;
+	d->list = malloc(sizeof(int) * n);
+	d->kernel = malloc(sizeof(int) * (n + 1));
+	d->stack = malloc(sizeof(int) * (3 * n + 1));
+	d->mark = calloc(n, sizeof(int));
+	d->gen = 0;
+	editor_dfa_flush(d);
+}
+
+void editor_dfa_free(struct dfa *d) {
+	if (d->states == NULL)
+		return;
+	editor_dfa_flush(d);
+	free(d->states);
+	free(d->table);
+	free(d->list);
+	free(d->kernel);
+	free(d->stack);
+	free(d->mark);
+	d->states = NULL;
+}
+
+int editor_dfa_closure(struct dfa *d, const int *pcs, int n, int flags, int next, int *matched) {
+	struct re_inst *insts = d->re->insts;
+	int top = 0, count = 0;
+	d->gen++;
+	if (next < 0 || (next & 0xC0) != 0x80)
+		d->stack[top++] = 0;
+	for (int k = n - 1; k >= 0; k--)
+		d->stack[top++] = pcs[k];
+	while (top) {
+		int pc = d->stack[--top];
+		if (d->mark[pc] == d->gen)
+			continue;
+		d->mark[pc] = d->gen;
+		struct re_inst *in = &insts[pc];
+		switch (in->op) {
+			case RE_RANGE:
+				d->list[count++] = pc;
+				break;
+			case RE_MATCH:
+				*matched = 1;
+				break;
+			case RE_SPLIT:
+				d->stack[top++] = in->y;
+				d->stack[top++] = in->x;
+				break;
+			case RE_JMP:
+				d->stack[top++] = in->x;
+				break;
+			default:
+				if (editor_re_assert(in->op, flags, next))
+					d->stack[top++] = pc + 1;
+		}
+	}
+	return count;
+}
+
+int editor_dfa_state(struct dfa *d, const int *pcs, int n, int flags) {
+	unsigned int h = 2166136261u ^ flags;
+	for (int k = 0; k < n; k++)
+		h = (h ^ pcs[k]) * 16777619u;
+	unsigned int size = KILO_DFA_STATES * 2, i = h % size;
+	for (; d->table[i] >= 0; i = (i + 1) % size) {
+		struct dfa_state *s = &d->states[d->table[i]];
+		if (s->flags == flags && s->n == n && !memcmp(s->pcs, pcs, sizeof(int) * n))
+			return d->table[i];
+	}
+	if (d->count == KILO_DFA_STATES)
+		return -1;
+	struct dfa_state *s = &d->states[d->count];
+	s->pcs = malloc(sizeof(int) * n);
+	memcpy(s->pcs, pcs, sizeof(int) * n);
+	s->n = n;
+	s->flags = flags;
+	s->eol = -1;
+	memset(s->next, -1, sizeof(s->next));
+	d->table[i] = d->count;
+	return d->count++;
+}
+
+int editor_dfa_step(struct dfa *d, int state, unsigned char c) {
+	struct dfa_state *s = &d->states[state];
+	int matched = 0;
+	int count = editor_dfa_closure(d, s->pcs, s->n, s->flags, c, &matched);
+	if (matched)
+		return s->next[c] = DFA_MATCH;
+	int n = 0;
+	for (int k = 0; k < count; k++) {
+		struct re_inst *in = &d->re->insts[d->list[k]];
+		if (c >= in->lo && c <= in->hi)
+			d->kernel[n++] = d->list[k] + 1;
+	}
+	qsort(d->kernel, n, sizeof(int), editor_re_compare);
+	int flags = editor_re_flags(s->flags, c);
+	int next = editor_dfa_state(d, d->kernel, n, flags);
+	if (next >= 0)
+		return s->next[c] = next;
+	editor_dfa_flush(d);
+	return editor_dfa_state(d, d->kernel, n, flags);
+}
+
+int editor_dfa_test(struct dfa *d, const char *s, int len) {
+	const unsigned char *u = (const unsigned char *)s;
+	if (d->start < 0 && (d->start = editor_dfa_state(d, d->kernel, 0, DFA_BOL)) < 0) {
+		editor_dfa_flush(d);
+		d->start = editor_dfa_state(d, d->kernel, 0, DFA_BOL);
+	}
+	int state = d->start;
+	for (int i = 0; i < len; i++) {
+		int next = d->states[state].next[u[i]];
+		if (next == DFA_UNKNOWN)
+			next = editor_dfa_step(d, state, u[i]);
+		if (next == DFA_MATCH)
+			return 1;
+		state = next;
+	}
+	struct dfa_state *st = &d->states[state];
+	if (st->eol < 0) {
+		int matched = 0;
+		editor_dfa_closure(d, st->pcs, st->n, st->flags, -1, &matched);
+		st->eol = matched;
+	}
+	return st->eol;
+}
+
+/* row allocator */
+
+int SLAB_SIZES[KILO_SLAB_CLASSES] = {
+	16, 32, 48, 64, 80, 96, 112, 128, 144, 160, 176, 192, 208, 224, 240, 256,
+	320, 384, 448, 512, 640, 768, 896, 1024, 1280, 1536, 1792, 2048, 2560, 3072, 3584, 4096
+};
+
+int editor_slab_class(int size) {
+	int c = 0;
+	while (c < KILO_SLAB_CLASSES && SLAB_SIZES[c] < size)
+		c++;
+	return c;
+}
+
+void editor_slab_retire() {
+	for (int c = KILO_SLAB_CLASSES - 1; c >= 0; c--) {
+		while (e.arena_left >= SLAB_SIZES[c]) {
+			*(void **)e.arena = e.slab_free[c];
+			e.slab_free[c] = e.arena;
+			e.arena += SLAB_SIZES[c];
+			e.arena_left -= SLAB_SIZES[c];
+		}
+	}
+}
+
+void editor_slab_reset() {
+	while (e.arenas) {
+		char *next = *(char **)e.arenas;
+		free(e.arenas);
+		e.arenas = next;
+	}
+	e.arenas = NULL;
+	e.arena = NULL;
+	e.arena_left = 0;
+	memset(e.slab_free, 0, sizeof(e.slab_free));
+}
+
+void *editor_slab_alloc(int *cap, int need) {
+	int c = editor_slab_class(need);
+	if (c == KILO_SLAB_CLASSES) {
+		if (cap)
+			*cap = need;
+		return malloc(need);
+	}
+	int size = SLAB_SIZES[c];
+	if (cap)
+		*cap = size;
+	void *p = e.slab_free[c];
+	if (p) {
+		e.slab_free[c] = *(void **)p;
+		return p;
+	}
+	if (e.arena_left < size) {
+		editor_slab_retire();
+		char *arena = malloc(KILO_ARENA_SIZE);
+		*(char **)arena = e.arenas;
+		e.arenas = arena;
+		e.arena = arena + 16;
+		e.arena_left = KILO_ARENA_SIZE - 16;
+	}
+	p = e.arena;
+	e.arena += size;
+	e.arena_left -= size;
+	return p;
+}
+
+void editor_slab_free(void *p, int cap) {
+	if (p == NULL)
+		return;
+	int c = editor_slab_class(cap);
+	if (c == KILO_SLAB_CLASSES) {
+		free(p);
+		return;
+	}
+	*(void **)p = e.slab_free[c];
+	e.slab_free[c] = p;
+}
+
+void *editor_slab_reserve(void *buf, int *cap, int need) {
+	if (need <= *cap)
+		return buf;
+	int grow = (*cap * 2 > need) ? *cap * 2 : need;
+	if (*cap > SLAB_SIZES[KILO_SLAB_CLASSES - 1]) {
+		*cap = grow;
+		return realloc(buf, grow);
+	}
+	int old = *cap;
+	void *p = editor_slab_alloc(cap, grow);
+	if (old)
+		memcpy(p, buf, old);
+	editor_slab_free(buf, old);
+	return p;
+}
+
+/* row tree */
+
+int editor_row_count(erow *t) {
+	return t ? t->count : 0;
+}
+
+void editor_row_pull(erow *t) {
+	t->count = t->lines + editor_row_count(t->left) + editor_row_count(t->right);
+	t->hl_min = t->hl_gen;
+	if (t->left) {
+		t->left->parent = t;
+		if (t->left->hl_min < t->hl_min)
+			t->hl_min = t->left->hl_min;
+	}
+	if (t->right) {
+		t->right->parent = t;
+		if (t->right->hl_min < t->hl_min)
+			t->hl_min = t->right->hl_min;
+	}
+}
+
+erow *editor_row_merge(erow *a, erow *b) {
+	if (a == NULL)
+		return b;
+	if (b == NULL)
+		return a;
+	if (a->prio > b->prio) {
+		a->right = editor_row_merge(a->right, b);
+		editor_row_pull(a);
+		return a;
+	}
+	b->left = editor_row_merge(a, b->left);
+	editor_row_pull(b);
+	return b;
+}
+
+void editor_row_split(erow *t, int at, erow **a, erow **b) {
+	if (t == NULL) {
+		*a = NULL;
+		*b = NULL;
+		return;
+	}
+	if (editor_row_count(t->left) < at) {
+		editor_row_split(t->right, at - editor_row_count(t->left) - t->lines, &t->right, b);
+		editor_row_pull(t);
+		*a = t;
+	} else {
+		editor_row_split(t->left, at, a, &t->left);
+		editor_row_pull(t);
+		*b = t;
+	}
+}
+
+void editor_row_set_root(erow *t) {
+	e.tree_gen++;
+	e.root = t;
+	if (t)
+		t->parent = NULL;
+	e.numrows = editor_row_count(t);
+}
+
+void editor_row_pull_all(erow *t) {
+	if (t == NULL)
+		return;
+	editor_row_pull_all(t->left);
+	editor_row_pull_all(t->right);
+	editor_row_pull(t);
+}
+
+erow *editor_row_build(erow **rows, int n) {
+	int top = 0;
+	for (int i = 0; i < n; i++) {
+		erow *row = rows[i];
+		erow *last = NULL;
+		while (top > 0 && rows[top - 1]->prio < row->prio)
+			last = rows[--top];
+		row->left = last;
+		if (top > 0)
+			rows[top - 1]->right = row;
+		rows[top++] = row;
+	}
+	if (top == 0)
+		return NULL;
+	editor_row_pull_all(rows[0]);
+	return rows[0];
+}
+
+erow *editor_row_node(int at, int *offset) {
+	erow *t = e.root;
+	while (t) {
+		int left = editor_row_count(t->left);
+		if (at < left)
+			t = t->left;
+		else if (at < left + t->lines) {
+			*offset = at - left;
+			return t;
+		} else {
+			at -= left + t->lines;
+			t = t->right;
+		}
+	}
+	return NULL;
+}
+
+int editor_row_index(erow *row) {
+	int at = editor_row_count(row->left);
+	for (; row->parent; row = row->parent)
+		if (row == row->parent->right)
+			at += editor_row_count(row->parent->left) + row->parent->lines;
+	return at;
+}
+
+erow *editor_row_first() {
+	erow *row = e.root;
+	while (row && row->left)
+		row = row->left;
+	return row;
+}
+
+erow *editor_row_next(erow *row) {
+	if (row->right) {
+		row = row->right;
+		while (row->left)
+			row = row->left;
+		return row;
+	}
+	while (row->parent && row == row->parent->right)
+		row = row->parent;
+	return row->parent;
+}
+
+erow *editor_row_prev(erow *row) {
+	if (row->left) {
+		row = row->left;
+		while (row->right)
+			row = row->right;
+		return row;
+	}
+	while (row->parent && row == row->parent->left)
+		row = row->parent;
+	return row->parent;
+}
+
+erow *editor_new_node(int lines) {
+	erow *row = editor_slab_alloc(NULL, sizeof(erow));
+	row->left = NULL;
+	row->right = NULL;
+	row->parent = NULL;
+	row->prio = rand();
+	row->count = lines;
+	row->lines = lines;
+	row->map_line = 0;
+	row->size = 0;
+	row->rsize = 0;
+	row->cap = 0;
+	row->render_cap = 0;
+	row->wmap_cap = 0;
+	row->marks = NULL;
+	row->mark_count = 0;
+	row->mark_cap = 0;
+	row->chars = NULL;
+	row->render = NULL;
+	row->wmap = NULL;
+	row->runs = NULL;
+	row->run_count = 0;
+	row->run_cap = 0;
+	row->run_hint = 0;
+	row->run_base = 0;
+	row->scan = 0;
+	row->hl_open_comment = 0;
+	row->hl_start = 0;
+	row->hl_gen = 0;
+	row->hl_min = 0;
+	row->valid = 0;
+	row->version = 0;
+	row->cache_slot = -1;
+	return row;
+}
+
+/* file map */
+
+char *editor_map_line(int line, int *len) {
+	size_t start = e.map_lines[line];
+	size_t end = e.map_lines[line + 1];
+	while (end > start && (e.map[end - 1] == '\n' || e.map[end - 1] == '\r'))
+		end--;
+	*len = end - start;
+	return &e.map[start];
+}
+
+void editor_map_free() {
+	if (e.map_heap)
+		free(e.map);
+	else if (e.map)
+		munmap(e.map, e.map_size);
+	free(e.map_lines);
+	e.map = NULL;
+	e.map_size = 0;
+	e.map_lines = NULL;
+	e.map_heap = 0;
+}
+
+int editor_map_open(FILE *fp) {
+	struct stat st;
+	if (fstat(fileno(fp), &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0)
+		return -1;
+	size_t size = st.st_size;
+	char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+	if (map == MAP_FAILED)
+		return -1;
+	size_t cap = 1024;
+	size_t n = 0;
+	size_t *lines = malloc(cap * sizeof(size_t));
+	size_t off = 0;
+	while (off < size) {
+		if (n + 2 > cap) {
+			cap *= 2;
+			lines = realloc(lines, cap * sizeof(size_t));
+		}
+		lines[n++] = off;
+		char *nl = memchr(&map[off], '\n', size - off);
+		off = nl ? (size_t)(nl - map) + 1 : size;
+	}
+	lines[n] = size;
+	if (n > KILO_SPAN_LINES * (size_t)(1 << 20)) {
+		munmap(map, size);
+		free(lines);
+		return -1;
+	}
+	e.map = map;
+	e.map_size = size;
+	e.map_lines = lines;
+	e.map_heap = 0;
+	erow *root = NULL;
+	for (size_t first = 0; first < n; first += KILO_SPAN_LINES) {
+		erow *span = editor_new_node(n - first < KILO_SPAN_LINES ? n - first : KILO_SPAN_LINES);
+		span->map_line = first;
+		root = editor_row_merge(root, span);
+	}
+	editor_row_set_root(root);
+	return 0;
+}
+
+void editor_map_rebind(char *map, size_t size, size_t *lines, int heap) {
+	editor_map_free();
+	e.map = map;
+	e.map_size = size;
+	e.map_lines = lines;
+	e.map_heap = heap;
+	int line = 0;
+	erow *row;
+	for (row = editor_row_first(); row; row = editor_row_next(row)) {
+		if (row->chars == NULL)
+			row->map_line = line;
+		line += row->lines;
+	}
+}
+
+/* syntax highlighting */
+
+int is_separator(int c) {
+	return e.char_class[(unsigned char)c] & CLASS_SEP;
+}
+
+unsigned int editor_keyword_hash(const char *s, int len, unsigned int seed) {
+	unsigned int h = seed ^ len;
+	for (int k = 0; k < len; k++)
+		h = (h ^ (unsigned char)s[k]) * 16777619u;
+	return h ^ (h >> 15);
+}
+
+struct keyword *editor_keyword_lookup(struct syntax_table *t, const char *s, int len) {
+	if (len < t->min_len || len > t->max_len)
+		return NULL;
+	struct keyword *kw = &t->keywords[editor_keyword_hash(s, len, t->seed) & t->mask];
+	return (kw->s && kw->len == len && !memcmp(kw->s, s, len)) ? kw : NULL;
+}
+
+int editor_keyword_place(struct syntax_table *t, char **keywords, unsigned int mask, unsigned int seed) {
+	struct keyword *table = calloc(mask + 1, sizeof(struct keyword));
+	t->min_len = t->max_len = 0;
+	for (int j = 0; keywords[j]; j++) {
+		char *k = keywords[j];
+		int len = strlen(k);
+		int hl = HL_KEYWORD1;
+		if (len > 0 && k[len - 1] == '|') {
+			len--;
+			hl = HL_KEYWORD2;
+		}
+		if (len == 0)
+			continue;
+		struct keyword *kw = &table[editor_keyword_hash(k, len, seed) & mask];
+		if (kw->s) {
+			if (kw->len == len && !memcmp(kw->s, k, len))
+				continue;
+			free(table);
+			return 0;
+		}
+		*kw = (struct keyword){k, len, hl};
+		if (t->min_len == 0 || len < t->min_len)
+			t->min_len = len;
+		if (len > t->max_len)
+			t->max_len = len;
+	}
+	t->keywords = table;
+	t->mask = mask;
+	t->seed = seed;
+	return 1;
+}
+
+void editor_syntax_compile(struct editor_syntax *syntax) {
+	struct syntax_table *t = malloc(sizeof(struct syntax_table));
+	syntax->table = t;
+	memcpy(t->cls, e.char_class, sizeof(t->cls));
+	if (syntax->singleline_comment_start && syntax->singleline_comment_start[0])
+		t->cls[(unsigned char)syntax->singleline_comment_start[0]] |= CLASS_COMMENT;
+	if (syntax->multiline_comment_start && syntax->multiline_comment_start[0])
+		t->cls[(unsigned char)syntax->multiline_comment_start[0]] |= CLASS_COMMENT;
+	if (syntax->multiline_comment_end && syntax->multiline_comment_end[0])
+		t->cls[(unsigned char)syntax->multiline_comment_end[0]] |= CLASS_COMMENT_END;
+	unsigned int size = 4;
+	for (int n = 0; syntax->keywords[n]; n++)
+		if ((unsigned int)n * 2 >= size)
+			size *= 2;
+	while (1) {
+		for (unsigned int seed = 1; seed <= 256; seed++)
+			if (editor_keyword_place(t, syntax->keywords, size - 1, seed))
+				return;
+		size *= 2;
+	}
+}
+
+void editor_syntax_init() {
+	for (int c = 0; c < 128; c++) {
+		if (isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c))
+			e.char_class[c] |= CLASS_SEP;
+		if (isdigit(c))
+			e.char_class[c] |= CLASS_DIGIT;
+	}
+	for (unsigned int j = 0; j < HLDB_ENTRIES; j++)
+		editor_syntax_compile(&HLDB[j]);
+}
+
+int editor_syntax_skim(struct editor_syntax *syntax, const char *s, size_t len, int in_comment) {
+	if (syntax == NULL)
+		return 0;
+	char *scs = syntax->singleline_comment_start;
+	char *mcs = syntax->multiline_comment_start;
+	char *mce = syntax->multiline_comment_end;
+	size_t scs_len = scs ? strlen(scs) : 0;
+	size_t mcs_len = mcs ? strlen(mcs) : 0;
+	size_t mce_len = mce ? strlen(mce) : 0;
+	unsigned char *cls = syntax->table->cls;
+	int in_string = 0;
+	size_t i = 0;
+	while (i < len) {
+		char c = s[i];
+		if (c == '\n') {
+			in_string = 0;
+			i++;
+			continue;
+		}
+		if (in_comment && !(cls[(unsigned char)c] & CLASS_COMMENT_END)) {
+			i++;
+			continue;
+		}
+		if (scs_len && !in_string && !in_comment && (cls[(unsigned char)c] & CLASS_COMMENT))
+			if (len - i >= scs_len && !memcmp(&s[i], scs, scs_len)) {
+				char *nl = memchr(&s[i], '\n', len - i);
+				if (nl == NULL)
+					break;
+				i = nl - s;
+				continue;
+			}
+		if (mcs_len && mce_len && !in_string) {
+			if (in_comment) {
+				if (len - i >= mce_len && !memcmp(&s[i], mce, mce_len)) {
+					i += mce_len;
+					in_comment = 0;
+				} else
+					i++;
+				continue;
+			} else if ((cls[(unsigned char)c] & CLASS_COMMENT) && len - i >= mcs_len && !memcmp(&s[i], mcs, mcs_len)) {
+				i += mcs_len;
+				in_comment = 1;
+				continue;
+			}
+		}
+		if (syntax->flags & HL_HIGHLIGHT_STRINGS) {
+			if (in_string) {
+				if (c == '\\' && i + 1 < len && s[i + 1] != '\n') {
+					i += 2;
+					continue;
+				}
+				if (c == in_string)
+					in_string = 0;
+				i++;
+				continue;
+			} else if (c == '"' || c == '\'') {
+				in_string = c;
+				i++;
+				continue;
+			}
+		}
+		i++;
+	}
+	return in_comment;
+}
+
+char *editor_span_text(erow *span, size_t *len) {
+	size_t start = e.map_lines[span->map_line];
+	*len = e.map_lines[span->map_line + span->lines] - start;
+	return &e.map[start];
+}
+
+int editor_span_skim(erow *span, int in_comment) {
+	size_t len;
+	char *s = editor_span_text(span, &len);
+	return editor_syntax_skim(e.syntax, s, len, in_comment);
+}
+
+void editor_syntax_mark(erow *row, int gen) {
+	row->hl_gen = gen;
+	if (gen == 0)
+		pthread_cond_signal(&e.hl_cond);
+	for (; row; row = row->parent) {
+		int min = row->hl_gen;
+		if (row->left && row->left->hl_min < min)
+			min = row->left->hl_min;
+		if (row->right && row->right->hl_min < min)
+			min = row->right->hl_min;
+		row->hl_min = min;
+	}
+}
+
+erow *editor_syntax_dirty() {
+	erow *t = e.root;
+	if (t == NULL || t->hl_min == e.hl_gen)
+		return NULL;
+	for (;;) {
+		if (t->left && t->left->hl_min < e.hl_gen)
+			t = t->left;
+		else if (t->hl_gen < e.hl_gen)
+			return t;
+		else
+			t = t->right;
+	}
+}
+
+void editor_syntax_sync(int limit) {
+	erow *row = editor_syntax_dirty();
+	int at = row ? editor_row_index(row) : 0;
+	while (row && at < limit) {
+		erow *prev = editor_row_prev(row);
+		int in_comment = prev ? prev->hl_open_comment : 0;
+		if (row->chars)
+			in_comment = editor_syntax_skim(e.syntax, row->chars, row->size, in_comment);
+		else
+			in_comment = editor_span_skim(row, in_comment);
+		int changed = (row->hl_open_comment != in_comment);
+		row->hl_open_comment = in_comment;
+		editor_syntax_mark(row, e.hl_gen);
+		erow *next = editor_row_next(row);
+		if (changed && next)
+			editor_syntax_mark(next, 0);
+		if (next && next->hl_gen < e.hl_gen)
+			at += row->lines;
+		else if ((next = editor_syntax_dirty()))
+			at = editor_row_index(next);
+		row = next;
+	}
+}
+
+void editor_syntax_sync_visible() {
+	erow *row = editor_syntax_dirty();
+	if (row && editor_row_index(row) + row->lines >= e.rowoff - KILO_PREFETCH_ROWS)
+		editor_syntax_sync(e.rowoff + e.screenrows + KILO_PREFETCH_ROWS);
+}
+
+int editor_syntax_reach(struct editor_syntax *syntax) {
+	int reach = 1;
+	char *delims[3] = {syntax->singleline_comment_start, syntax->multiline_comment_start, syntax->multiline_comment_end};
+	for (int k = 0; k < 3; k++)
+		if (delims[k] && (int)strlen(delims[k]) > reach)
+			reach = strlen(delims[k]);
+	return reach;
+}
+
+int editor_syntax_scan(struct editor_syntax *syntax, const char *render, int rsize, int i, int in_comment, unsigned char *hl, int stop) {
+	if (syntax == NULL) {
+		memset(&hl[i], HL_NORMAL, (stop < rsize ? stop : rsize) - i);
+		return stop < rsize ? -1 : 0;
+	}
+	unsigned char *cls = syntax->table->cls;
+	char *scs = syntax->singleline_comment_start;
+	char *mcs = syntax->multiline_comment_start;
+	char *mce = syntax->multiline_comment_end;
+	int scs_len = scs ? strlen(scs) : 0;
+	int mcs_len = mcs ? strlen(mcs) : 0;
+	int mce_len = mce ? strlen(mce) : 0;
+	int prev_sep = 1;
+	int in_string = 0;
+	int last = -1;
+	unsigned char old = HL_NORMAL;
+	while (i < rsize) {
+		if (i > stop && last == i - 1 && old == HL_NORMAL && prev_sep && !in_string && !in_comment && (cls[(unsigned char)render[i - 1]] & CLASS_SEP))
+			return -1;
+		last = i;
+		old = (i >= stop) ? hl[i] : HL_NORMAL;
+		char c = render[i];
+		unsigned char cc = cls[(unsigned char)c];
+		unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;
+		if (scs_len && !in_string && !in_comment && (cc & CLASS_COMMENT))
+			if (!strncmp(&render[i], scs, scs_len)) {
+				memset(&hl[i], HL_COMMENT, rsize - i);
+				break;
+			}
+		if (mcs_len && mce_len && !in_string) {
+			if (in_comment) {
+				hl[i] = HL_MLCOMMENT;
+				if ((cc & CLASS_COMMENT_END) && !strncmp(&render[i], mce, mce_len)) {
+					memset(&hl[i], HL_MLCOMMENT, mce_len);
+					i += mce_len;
+					in_comment = 0;
+					prev_sep = 1;
+					continue;
+				} else {
+					i++;
+					continue;
+				}
+			} else if ((cc & CLASS_COMMENT) && !strncmp(&render[i], mcs, mcs_len)) {
+				memset(&hl[i], HL_MLCOMMENT, mcs_len);
+				i += mcs_len;
+				in_comment = 1;
+				continue;
+			}
+		}
+		if (syntax->flags & HL_HIGHLIGHT_STRINGS) {
+			if (in_string) {
+				hl[i] = HL_STRING;
+				if (c == '\\' && i + 1 < rsize) {
+					hl[i + 1] = HL_STRING;
+					i += 2;
+					continue;
+				}
+				if (c == in_string)
+					in_string = 0;
+				i++;
+				prev_sep = 1;
+				continue;
+			} else if (c == '"' || c == '\'') {
+				in_string = c;
+				hl[i] = HL_STRING;
+				i++;
+				continue;
+			}
+		}
+		if (syntax->flags & HL_HIGHLIGHT_NUMBERS)
+			if (((cc & CLASS_DIGIT) && (prev_sep || prev_hl == HL_NUMBER)) || (c == '.' && prev_hl == HL_NUMBER)) {
+				hl[i] = HL_NUMBER;
+				i++;
+				prev_sep = 0;
+				continue;
+			}
+		if (prev_sep && !(cc & CLASS_SEP)) {
+			int len = 1;
+			while (i + len < rsize && !(cls[(unsigned char)render[i + len]] & CLASS_SEP))
+				len++;
+			struct keyword *kw = editor_keyword_lookup(syntax->table, &render[i], len);
+			if (kw) {
+				memset(&hl[i], kw->hl, len);
+				i += len;
+				prev_sep = 0;
+				continue;
+			}
+		}
+		hl[i] = HL_NORMAL;
+		prev_sep = cc & CLASS_SEP;
+		i++;
+	}
+	return in_comment;
+}
+
+void editor_syntax_highlight(struct editor_syntax *syntax, const char *render, int rsize, int in_comment, unsigned char *hl) {
+	editor_syntax_scan(syntax, render, rsize, 0, in_comment, hl, rsize);
+}
+
+int editor_hl_pack(struct hl_run **runs, int *cap, const unsigned char *hl, int n) {
+	int count = 0;
+	int i = 0;
+	while (i < n) {
+		int j = i + 1;
+		while (j < n && hl[j] == hl[i] && j - i < KILO_HL_RUN_MAX)
+			j++;
+		*runs = editor_reserve(*runs, cap, (count + 1) * sizeof(struct hl_run));
+		(*runs)[count++] = (struct hl_run){j - i, hl[i]};
+		i = j;
+	}
+	return count;
+}
+
+int editor_hl_seek(erow *row, int pos, int *base) {
+	int k = row->run_hint, b = row->run_base;
+	while (k > 0 && b > pos)
+		b -= row->runs[--k].len;
+	while (k < row->run_count && b + row->runs[k].len <= pos)
+		b += row->runs[k++].len;
+	row->run_hint = k;
+	row->run_base = b;
+	*base = b;
+	return k;
+}
+
+void editor_hl_unpack(erow *row, int k, int base, int from, int to, unsigned char *hl) {
+	for (int p = from; p < to; k++) {
+		int end = base + row->runs[k].len;
+		if (end > to)
+			end = to;
+		if (end > p) {
+			memset(&hl[p - from], row->runs[k].hl, end - p);
+			p = end;
+		}
+		base += row->runs[k].len;
+	}
+}
+
+void editor_hl_splice(erow *row, int from, int old_end, const unsigned char *hl, int len) {
+	int b0;
+	int k0 = editor_hl_seek(row, from, &b0);
+	int b1;
+	int k1 = editor_hl_seek(row, old_end, &b1);
+	int mid = editor_hl_pack(&e.hl_runs, &e.hl_runs_cap, hl, len);
+	int head = k0 + (from > b0);
+	int tail = row->run_count - k1;
+	int count = head + mid + tail;
+	row->runs = editor_reserve(row->runs, &row->run_cap, (count + 1) * sizeof(struct hl_run));
+	memmove(&row->runs[head + mid], &row->runs[k1], tail * sizeof(struct hl_run));
+	if (tail)
+		row->runs[head + mid].len -= old_end - b1;
+	if (from > b0)
+		row->runs[k0].len = from - b0;
+	if (mid)
+		memcpy(&row->runs[head], e.hl_runs, mid * sizeof(struct hl_run));
+	row->run_count = count;
+	row->run_hint = k0;
+	row->run_base = b0;
+}
+
+void editor_hl_stretch(erow *row, int pos, int by) {
+	int base;
+	int k = editor_hl_seek(row, pos, &base);
+	if (by < 0) {
+		int avail = base + row->runs[k].len - pos;
+		while (1) {
+			int take = (-by < avail) ? -by : avail;
+			row->runs[k].len -= take;
+			by += take;
+			if (by == 0)
+				return;
+			avail = row->runs[++k].len;
+		}
+	}
+	int len = row->runs[k].len + by;
+	if (len > KILO_HL_RUN_MAX) {
+		memmove(&row->runs[k + 1], &row->runs[k], (row->run_count - k) * sizeof(struct hl_run));
+		row->run_count++;
+		row->runs[k + 1].len = len - KILO_HL_RUN_MAX;
+		len = KILO_HL_RUN_MAX;
+	}
+	row->runs[k].len = len;
+}
+
+void editor_row_highlight(erow *row, int in_comment) {
+	e.hl = editor_reserve(e.hl, &e.hl_cap, row->rsize + 1);
+	editor_syntax_highlight(e.syntax, row->render, row->rsize, in_comment, e.hl);
+	row->run_count = editor_hl_pack(&row->runs, &row->run_cap, e.hl, row->rsize);
+	row->run_hint = row->run_base = 0;
+}
+
+void editor_syntax_apply(struct hl_job *jobs, int n, int tree_gen, int hl_gen) {
+	if (n == 0 || e.tree_gen != tree_gen || e.hl_gen != hl_gen)
+		return;
+	erow *prev = editor_row_prev(jobs[0].row);
+	if ((prev ? prev->hl_open_comment : 0) != jobs[0].start)
+		return;
+	int at = editor_row_index(jobs[0].row);
+	int lines = 0;
+	for (int k = 0; k < n; k++) {
+		struct hl_job *j = &jobs[k];
+		erow *row = j->row;
+		if (row->version != j->version)
+			break;
+		int changed = (row->hl_open_comment != j->end);
+		row->hl_open_comment = j->end;
+		editor_syntax_mark(row, hl_gen);
+		erow *next = editor_row_next(row);
+		if (changed && next)
+			editor_syntax_mark(next, 0);
+		if (j->render && (row->valid & ROW_RENDER) && row->rsize == j->rsize) {
+			free(row->runs);
+			row->runs = j->runs;
+			row->run_count = j->run_count;
+			row->run_cap = j->run_count * sizeof(struct hl_run);
+			row->run_hint = row->run_base = 0;
+			row->hl_start = j->start;
+			row->valid |= ROW_HL;
+			j->runs = NULL;
+		}
+		lines += row->lines;
+	}
+	if (at + lines > e.rowoff - 1 && at < e.rowoff + e.screenrows && !e.hl_redraw) {
+		uint64_t one = 1;
+		e.hl_redraw = 1;
+		write(e.hl_event, &one, sizeof(one));
+	}
+}
+
+erow *editor_syntax_collect(struct hl_chunk *c, erow *row, int hl_gen) {
+	size_t used = 0;
+	int lines = 0;
+	c->n = 0;
+	c->syntax = e.syntax;
+	for (; row && lines < KILO_HL_BATCH_LINES; row = editor_row_next(row)) {
+		struct hl_job *j = &c->jobs[c->n++];
+		size_t len = row->size;
+		char *s = row->chars ? row->chars : editor_span_text(row, &len);
+		if (used + len >= c->cap) {
+			c->cap = (used + len + 1) * 2;
+			c->buf = realloc(c->buf, c->cap);
+		}
+		memcpy(&c->buf[used], s, len);
+		j->row = row;
+		j->version = row->version;
+		j->text = used;
+		j->len = len;
+		j->clean = (row->hl_gen == hl_gen);
+		j->end = row->hl_open_comment;
+		j->render = NULL;
+		j->runs = NULL;
+		if (row->valid & ROW_RENDER) {
+			j->rsize = row->rsize;
+			j->render = malloc(row->rsize + 1);
+			memcpy(j->render, row->render, row->rsize + 1);
+		}
+		used += len;
+		lines += row->lines;
+	}
+	return row;
+}
+
+int editor_syntax_lex(struct hl_chunk *c, int in_comment, int settle, int fixup) {
+	for (c->done = 0; c->done < c->n; c->done++) {
+		struct hl_job *j = &c->jobs[c->done];
+		if (fixup && j->start == in_comment)
+			return c->jobs[c->n - 1].end;
+		j->start = in_comment;
+		if (j->render) {
+			int cap = 0;
+			free(j->runs);
+			j->runs = NULL;
+			c->hl = editor_reserve(c->hl, &c->hl_cap, j->rsize + 1);
+			editor_syntax_highlight(c->syntax, j->render, j->rsize, in_comment, c->hl);
+			j->run_count = editor_hl_pack(&j->runs, &cap, c->hl, j->rsize);
+		}
+		in_comment = editor_syntax_skim(c->syntax, &c->buf[j->text], j->len, in_comment);
+		int settled = (settle && in_comment == j->end && c->done + 1 < c->n && c->jobs[c->done + 1].clean);
+		j->end = in_comment;
+		if (settled) {
+			c->done++;
+			break;
+		}
+	}
+	return in_comment;
+}
+
+int editor_syntax_pool_take() {
+	if (e.hl_next >= e.hl_count)
+		return 0;
+	struct hl_chunk *c = &e.hl_chunks[e.hl_next++];
+	pthread_mutex_unlock(&e.pool_lock);
+	editor_syntax_lex(c, c->start, 0, 0);
+	pthread_mutex_lock(&e.pool_lock);
+	if (--e.hl_pending == 0)
+		pthread_cond_signal(&e.pool_done);
+	return 1;
+}
+
+void *editor_syntax_pool(void *arg) {
+	(void)arg;
+	pthread_mutex_lock(&e.pool_lock);
+	for (;;)
+		if (!editor_syntax_pool_take())
+			pthread_cond_wait(&e.pool_cond, &e.pool_lock);
+	return NULL;
+}
+
+void editor_syntax_parallel(int count) {
+	pthread_mutex_lock(&e.pool_lock);
+	e.hl_next = 1;
+	e.hl_count = count;
+	e.hl_pending = count - 1;
+	pthread_cond_broadcast(&e.pool_cond);
+	pthread_mutex_unlock(&e.pool_lock);
+	int in_comment = editor_syntax_lex(&e.hl_chunks[0], e.hl_chunks[0].start, 0, 0);
+	pthread_mutex_lock(&e.pool_lock);
+	while (editor_syntax_pool_take())
+		;
+	while (e.hl_pending)
+		pthread_cond_wait(&e.pool_done, &e.pool_lock);
+	pthread_mutex_unlock(&e.pool_lock);
+	for (int k = 1; k < count; k++) {
+		struct hl_chunk *c = &e.hl_chunks[k];
+		if (c->start == in_comment)
+			in_comment = c->jobs[c->n - 1].end;
+		else
+			in_comment = editor_syntax_lex(c, in_comment, 0, 1);
+		c->done = c->n;
+	}
+}
+
+void *editor_syntax_worker(void *arg) {
+	(void)arg;
+	pthread_mutex_lock(&e.lock);
+	for (;;) {
+		erow *row;
+		while ((row = editor_syntax_dirty()) == NULL)
+			pthread_cond_wait(&e.hl_cond, &e.lock);
+		erow *prev = editor_row_prev(row);
+		int tree_gen = e.tree_gen;
+		int hl_gen = e.hl_gen;
+		int count = 0;
+		int clean = 0;
+		do {
+			struct hl_chunk *c = &e.hl_chunks[count++];
+			c->start = prev ? prev->hl_open_comment : 0;
+			row = editor_syntax_collect(c, row, hl_gen);
+			for (int k = 0; k < c->n; k++)
+				clean |= c->jobs[k].clean;
+			if (row)
+				prev = editor_row_prev(row);
+		} while (row && !clean && count < e.hl_threads && row->hl_gen != hl_gen);
+		pthread_mutex_unlock(&e.lock);
+		if (count == 1)
+			editor_syntax_lex(&e.hl_chunks[0], e.hl_chunks[0].start, 1, 0);
+		else
+			editor_syntax_parallel(count);
+		pthread_mutex_lock(&e.lock);
+		for (int k = 0; k < count; k++) {
+			struct hl_chunk *c = &e.hl_chunks[k];
+			editor_syntax_apply(c->jobs, c->done, tree_gen, hl_gen);
+			for (int i = 0; i < c->n; i++) {
+				free(c->jobs[i].render);
+				free(c->jobs[i].runs);
+			}
+		}
+	}
+	return NULL;
+}
+
+void editor_syntax_start() {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	e.hl_threads = cpus < 1 ? 1 : cpus > KILO_HL_THREADS ? KILO_HL_THREADS : cpus;
+	for (int k = 0; k < e.hl_threads; k++) {
+		e.hl_chunks[k].jobs = malloc(sizeof(struct hl_job) * KILO_HL_BATCH_LINES);
+		e.hl_chunks[k].buf = NULL;
+		e.hl_chunks[k].cap = 0;
+		e.hl_chunks[k].hl = NULL;
+		e.hl_chunks[k].hl_cap = 0;
+	}
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, editor_syntax_worker, NULL) != 0)
+		die_last("pthread_create");
+	for (int k = 1; k < e.hl_threads; k++)
+		if (pthread_create(&thread, NULL, editor_syntax_pool, NULL) != 0)
+			die_last("pthread_create");
+}
+
+int editor_syntax_to_color(int hl) {
+	switch (hl) {
+		case HL_COMMENT:
+		case HL_MLCOMMENT:
+			return 36;
+
+		case HL_KEYWORD1:
+			return 33;
+
+		case HL_KEYWORD2:
+			return 32;
+
+		case HL_STRING:
+			return 35;
+
+		case HL_NUMBER:
+			return 31;
+
+		case HL_MATCH:
+			return 34;
+
+		default:
+			return 37;
+	}
+}
+
+void editor_select_syntax_highlight() {
+	e.syntax = NULL;
+	e.hl_gen++;
+	pthread_cond_signal(&e.hl_cond);
+	for (int k = 0; k < KILO_ROW_CACHE; k++)
+		if (e.cache[k])
+			e.cache[k]->valid &= ~ROW_HL;
+	if (e.filename == NULL)
+		return;
+	char *ext = strrchr(e.filename, '.');
+	for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
+		struct editor_syntax *s = &HLDB[j];
+		unsigned int i = 0;
+		while (s->filematch[i]) {
+			int is_ext = (s->filematch[i][0] == '.');
+			if ((is_ext && ext && !strcmp(ext, s->filematch[i])) || (!is_ext && strstr(e.filename, s->filematch[i]))) {
+				e.syntax = s;
+				return;
+			}
+			i++;
+		}
+	}
+}
+
+/* row operations */
+
+void *editor_reserve(void *buf, int *cap, int need) {
+	if (need <= *cap)
+		return buf;
+	*cap = (*cap * 2 > need) ? *cap * 2 : need;
+	return realloc(buf, *cap);
+}
+
+int editor_row_step(erow *row, int i, int *rb, int *rx) {
+	unsigned char c = row->chars[i];
+	if (c == '\t') {
+		int w = KILO_TAB_STOP - (*rx % KILO_TAB_STOP);
+		*rb += w;
+		*rx += w;
+		return i + 1;
+	}
+	if (c < 0x80) {
+		(*rb)++;
+		(*rx)++;
+		return i + 1;
+	}
+	int cp;
+	int n = editor_utf8_decode(&row->chars[i], row->size - i, &cp);
+	*rb += n;
+	*rx += (cp < 0) ? 1 : editor_char_width(cp);
+	return i + n;
+}
+
+void editor_row_walk(erow *row, int from, int to, int *rb, int *rx) {
+	int i = from;
+	if (i < to) {
+		int start = editor_utf8_start(row->chars, row->size, i);
+		if (start < i) {
+			int cp;
+			int end = start + editor_utf8_decode(&row->chars[start], row->size - start, &cp);
+			if (end > to)
+				end = to;
+			*rb += end - i;
+			i = end;
+		}
+	}
+	while (i < to) {
+		int next = editor_row_step(row, i, rb, rx);
+		if (next > to) {
+			*rb -= next - to;
+			next = to;
+		}
+		i = next;
+	}
+}
+
+struct col_mark editor_row_checkpoint(erow *row, int k) {
+	if (row->mark_count == 0) {
+		row->marks = editor_reserve(row->marks, &row->mark_cap, sizeof(struct col_mark));
+		row->marks[0].rb = 0;
+		row->marks[0].rx = 0;
+		row->mark_count = 1;
+	}
+	while (row->mark_count <= k) {
+		int c = row->mark_count;
+		row->marks = editor_reserve(row->marks, &row->mark_cap, (c + 1) * sizeof(struct col_mark));
+		struct col_mark m = row->marks[c - 1];
+		editor_row_walk(row, (c - 1) * KILO_RX_STRIDE, c * KILO_RX_STRIDE, &m.rb, &m.rx);
+		row->marks[c] = m;
+		row->mark_count++;
+	}
+	return row->marks[k];
+}
+
+void editor_row_locate(erow *row, int cx, int *rb, int *rx) {
+	int k = cx / KILO_RX_STRIDE;
+	struct col_mark m = {0, 0};
+	if (k > 0)
+		m = editor_row_checkpoint(row, k);
+	*rb = m.rb;
+	*rx = m.rx;
+	editor_row_walk(row, k * KILO_RX_STRIDE, cx, rb, rx);
+}
+
+int editor_row_cx_to_rx(erow *row, int cx) {
+	int rb, rx;
+	editor_row_locate(row, cx, &rb, &rx);
+	return rx;
+}
+
+int editor_row_cx_to_rb(erow *row, int cx) {
+	int rb, rx;
+	editor_row_locate(row, cx, &rb, &rx);
+	return rb;
+}
+
+int editor_row_rx_to_cx(erow *row, int rx) {
+	int cx = 0;
+	struct col_mark m = {0, 0};
+	if (row->size >= KILO_RX_STRIDE) {
+		int last = row->size / KILO_RX_STRIDE;
+		editor_row_checkpoint(row, 0);
+		while (row->mark_count <= last) {
+			struct col_mark *top = &row->marks[row->mark_count - 1];
+			if (top->rx > rx)
+				break;
+			editor_row_checkpoint(row, row->mark_count);
+		}
+		int lo = 0, hi = row->mark_count - 1;
+		while (lo < hi) {
+			int mid = (lo + hi + 1) / 2;
+			if (row->marks[mid].rx <= rx)
+				lo = mid;
+			else
+				hi = mid - 1;
+		}
+		if (lo > 0 && ((unsigned char)row->chars[lo * KILO_RX_STRIDE] & 0xC0) == 0x80)
+			lo--;
+		cx = lo * KILO_RX_STRIDE;
+		m = row->marks[lo];
+		int start = editor_utf8_start(row->chars, row->size, cx);
+		if (start < cx) {
+			int cp;
+			int end = start + editor_utf8_decode(&row->chars[start], row->size - start, &cp);
+			editor_row_walk(row, cx, end, &m.rb, &m.rx);
+			cx = end;
+		}
+	}
+	while (cx < row->size) {
+		int next = editor_row_step(row, cx, &m.rb, &m.rx);
+		if (m.rx > rx)
+			return cx;
+		cx = next;
+	}
+	return cx;
+}
+
+int editor_row_next_char(erow *row, int cx) {
+	int cp;
+	cx += editor_utf8_decode(&row->chars[cx], row->size - cx, &cp);
+	while (cx < row->size) {
+		int n = editor_utf8_decode(&row->chars[cx], row->size - cx, &cp);
+		if (cp < 0x300 || editor_char_width(cp) != 0)
+			break;
+		cx += n;
+	}
+	return cx;
+}
+
+int editor_row_prev_char(erow *row, int cx) {
+	int cp;
+	while (cx > 0) {
+		cx = editor_utf8_start(row->chars, row->size, cx - 1);
+		editor_utf8_decode(&row->chars[cx], row->size - cx, &cp);
+		if (cp < 0x300 || editor_char_width(cp) != 0)
+			break;
+	}
+	return cx;
+}
+
+int editor_render_span(const char *s, int n, int *rx, char *render, unsigned char *wmap) {
+	int idx = 0;
+	int j = 0;
+	while (j < n) {
+		if (s[j] == '\t') {
+			do {
+				if (render)
+					render[idx] = ' ';
+				if (wmap)
+					wmap[idx] = 1;
+				idx++;
+			} while (++*rx % KILO_TAB_STOP != 0);
+			j++;
+			continue;
+		}
+		int cp;
+		int k = editor_utf8_decode(&s[j], n - j, &cp);
+		int w = (cp < 0) ? 1 : editor_char_width(cp);
+		if (render)
+			memcpy(&render[idx], &s[j], k);
+		if (wmap) {
+			wmap[idx] = (cp < 0) ? (WMAP_BAD | 1) : w;
+			memset(&wmap[idx + 1], WMAP_CONT, k - 1);
+		}
+		idx += k;
+		j += k;
+		*rx += w;
+	}
+	return idx;
+}
+
+void editor_row_render_utf8(erow *row) {
+	int rx = 0;
+	int alias = row->render == row->chars;
+	row->wmap_cap = alias ? row->size + 1 : row->render_cap;
+	row->wmap = malloc(row->wmap_cap);
+	row->rsize = editor_render_span(row->chars, row->size, &rx, alias ? NULL : row->render, row->wmap);
+	row->render[row->rsize] = '\0';
+}
+
+void editor_row_render(erow *row) {
+	int tabs;
+	int j;
+	row->scan = e.scan(row->chars, row->size, &tabs);
+	if (row->render != row->chars)
+		editor_slab_free(row->render, row->render_cap);
+	free(row->wmap);
+	row->wmap = NULL;
+	if (!(row->scan & SCAN_TAB)) {
+		row->render = row->chars;
+		row->render_cap = 0;
+		row->rsize = row->size;
+		if (row->scan & SCAN_HIGH)
+			editor_row_render_utf8(row);
+		return;
+	}
+	row->render = editor_slab_alloc(&row->render_cap, row->size + tabs * (KILO_TAB_STOP - 1) + 1);
+	if (row->scan & SCAN_HIGH) {
+		editor_row_render_utf8(row);
+		return;
+	}
+	int idx = 0;
+	for (j = 0; j < row->size; j++) {
+		if (row->chars[j] == '\t') {
+			row->render[idx++] = ' ';
+			while (idx % KILO_TAB_STOP != 0)
+				row->render[idx++] = ' ';
+		} else
+			row->render[idx++] = row->chars[j];
+	}
+	row->render[idx] = '\0';
+	row->rsize = idx;
+}
+
+void editor_row_release(erow *row) {
+	if (row->render != row->chars)
+		editor_slab_free(row->render, row->render_cap);
+	free(row->wmap);
+	free(row->runs);
+	row->render = NULL;
+	row->wmap = NULL;
+	row->runs = NULL;
+	row->rsize = 0;
+	row->render_cap = 0;
+	row->run_count = 0;
+	row->run_cap = 0;
+	row->run_hint = row->run_base = 0;
+	row->valid = 0;
+}
+
+void editor_row_prepare(erow *row) {
+	erow *prev = editor_row_prev(row);
+	int in_comment = prev ? prev->hl_open_comment : 0;
+	if (!(row->valid & ROW_RENDER)) {
+		editor_row_render(row);
+		row->valid = ROW_RENDER;
+	}
+	if (!(row->valid & ROW_HL) || row->hl_start != in_comment) {
+		editor_row_highlight(row, in_comment);
+		row->hl_start = in_comment;
+		row->valid |= ROW_HL;
+	}
+	if (row->cache_slot >= 0) {
+		e.cache_seen[row->cache_slot] = e.frame_time;
+		return;
+	}
+	/* second chance: skip rows drawn this frame, clear and skip rows
+	 * touched since the last sweep, evict the first cold one */
+	int k = e.cache_next;
+	for (int n = 0; n < 2 * KILO_ROW_CACHE && e.cache[k]; n++) {
+		if (e.cache_seen[k] == 0)
+			break;
+		if (e.cache_seen[k] != e.frame_time)
+			e.cache_seen[k] = 0;
+		k = (k + 1) % KILO_ROW_CACHE;
+	}
+	erow *old = e.cache[k];
+	if (old) {
+		editor_row_release(old);
+		old->cache_slot = -1;
+	}
+	e.cache[k] = row;
+	e.cache_seen[k] = e.frame_time;
+	row->cache_slot = k;
+	e.cache_next = (k + 1) % KILO_ROW_CACHE;
+}
+
+void editor_update_row(erow *row) {
+	row->valid = 0;
+	row->mark_count = 0;
+	row->version++;
+	editor_syntax_mark(row, 0);
+}
+
+void editor_row_patch(erow *row, int at, const char *removed, int nremoved, int nadded) {
+	int alias = row->render == row->chars;
+	int added = e.scan(&row->chars[at], nadded, NULL);
+	if (!(row->valid & ROW_RENDER) || (!row->wmap && ((added & SCAN_HIGH) || !editor_is_ascii(removed, nremoved))) || (alias && (added & SCAN_TAB))) {
+		editor_update_row(row);
+		return;
+	}
+	/* widen the edit to whole characters so a byte typed or deleted
+	 * inside a UTF-8 sequence re-decodes its neighbours */
+	int lo = at, hi = at + nadded;
+	if (row->wmap) {
+		if (lo > 0)
+			lo--;
+		while (lo > 0 && at - lo < 4 && ((unsigned char)row->chars[lo] & 0xC0) == 0x80)
+			lo--;
+		if (lo < at && ((unsigned char)row->chars[lo] & 0xC0) == 0x80)
+			lo = at - 1;
+		while (hi < row->size && ((unsigned char)row->chars[hi] & 0xC0) == 0x80 && hi - at < 64)
+			hi++;
+		if (hi < row->size && ((unsigned char)row->chars[hi] & 0xC0) == 0x80) {
+			editor_update_row(row);
+			return;
+		}
+	}
+	char old[72];
+	int nold = (at - lo) + nremoved + (hi - at - nadded);
+	if (nold > (int)sizeof(old)) {
+		editor_update_row(row);
+		return;
+	}
+	memcpy(old, &row->chars[lo], at - lo);
+	if (nremoved)
+		memcpy(&old[at - lo], removed, nremoved);
+	memcpy(&old[at - lo + nremoved], &row->chars[at + nadded], hi - at - nadded);
+	if (row->mark_count > lo / KILO_RX_STRIDE + 1)
+		row->mark_count = lo / KILO_RX_STRIDE + 1;
+	row->scan |= added;
+	erow *prev = editor_row_prev(row);
+	int start = prev ? prev->hl_open_comment : 0;
+	int hl_ok = (row->valid & ROW_HL) && row->hl_gen == e.hl_gen && row->hl_start == start;
+	int rx, col;
+	editor_row_locate(row, lo, &rx, &col);
+	int old_col = col, new_col = col;
+	int old_mid = rx + editor_render_span(old, nold, &old_col, NULL, NULL);
+	int new_mid = rx + editor_render_span(&row->chars[lo], hi - lo, &new_col, NULL, NULL);
+	int delta = new_mid - old_mid;
+	int old_rsize = row->rsize;
+	int tab = -1, wo = 0, wn = 0;
+	char *t = alias ? NULL : memchr(&row->chars[hi], '\t', row->size - hi);
+	if (t) {
+		int gap = t - &row->chars[hi];
+		int tab_col = old_col + gap;
+		if (row->wmap) {
+			tab_col = old_col;
+			for (int k = old_mid; k < old_mid + gap; k++)
+				tab_col += row->wmap[k] & WMAP_WIDTH;
+		}
+		tab = new_mid + gap;
+		wo = KILO_TAB_STOP - tab_col % KILO_TAB_STOP;
+		wn = KILO_TAB_STOP - (tab_col + new_col - old_col) % KILO_TAB_STOP;
+	}
+	int rsize = old_rsize + delta + wn - wo;
+	int need = (rsize > old_rsize + delta ? rsize : old_rsize + delta) + 1;
+	if (!alias) {
+		row->render = editor_slab_reserve(row->render, &row->render_cap, need);
+		memmove(&row->render[new_mid], &row->render[old_mid], old_rsize - old_mid + 1);
+	}
+	if (row->wmap) {
+		row->wmap = editor_reserve(row->wmap, &row->wmap_cap, need);
+		memmove(&row->wmap[new_mid], &row->wmap[old_mid], old_rsize - old_mid);
+	}
+	if (tab >= 0 && wn != wo) {
+		int tail = old_rsize + delta - (tab + wo);
+		memmove(&row->render[tab + wn], &row->render[tab + wo], tail + 1);
+		memset(&row->render[tab], ' ', wn);
+		if (row->wmap) {
+			memmove(&row->wmap[tab + wn], &row->wmap[tab + wo], tail);
+			memset(&row->wmap[tab], 1, wn);
+		}
+	}
+	editor_render_span(&row->chars[lo], hi - lo, &col, alias ? NULL : &row->render[rx], row->wmap ? &row->wmap[rx] : NULL);
+	row->rsize = rsize;
+	row->version++;
+	if (!hl_ok) {
+		row->valid &= ~ROW_HL;
+		editor_syntax_mark(row, 0);
+		return;
+	}
+	int from = rx;
+	if (e.syntax)
+		from -= editor_syntax_reach(e.syntax) - 1;
+	if (from < 0)
+		from = 0;
+	int k, base;
+	if (from > 0) {
+		k = editor_hl_seek(row, from - 1, &base);
+		while (from > 0 && !(row->runs[k].hl == HL_NORMAL && is_separator(row->render[from - 1]))) {
+			from--;
+			while (from > 0 && from - 1 < base)
+				base -= row->runs[--k].len;
+		}
+	}
+	k = editor_hl_seek(row, from, &base);
+	int win_end = new_mid + KILO_HL_WINDOW;
+	int end;
+	while (1) {
+		if (tab >= 0 && win_end > tab && win_end < tab + wn)
+			win_end = tab + wn;
+		if (win_end > rsize)
+			win_end = rsize;
+		int tab_in = (tab >= 0 && tab < win_end);
+		int old_end = win_end - delta - (tab_in ? wn - wo : 0);
+		int len = win_end - from;
+		int old_len = old_end + delta - from;
+		unsigned char *hl = e.hl = editor_reserve(e.hl, &e.hl_cap, (len > old_len ? len : old_len) + 1);
+		editor_hl_unpack(row, k, base, from, old_end, hl);
+		memmove(&hl[new_mid - from], &hl[old_mid - from], old_end - old_mid);
+		if (tab_in && wn != wo) {
+			unsigned char tab_hl = hl[tab - from];
+			memmove(&hl[tab + wn - from], &hl[tab + wo - from], old_end + delta - (tab + wo));
+			memset(&hl[tab - from], tab_hl, wn);
+		}
+		end = editor_syntax_scan(e.syntax, &row->render[from], len, 0, from ? 0 : start, hl, new_mid - from);
+		if (end >= 0 && win_end < rsize) {
+			win_end = rsize;
+			continue;
+		}
+		editor_hl_splice(row, from, old_end, hl, len);
+		if (tab >= 0 && !tab_in && wn != wo)
+			editor_hl_stretch(row, tab, wn - wo);
+		break;
+	}
+	if (end >= 0 && end != row->hl_open_comment) {
+		row->hl_open_comment = end;
+		erow *next = editor_row_next(row);
+		if (next)
+			editor_syntax_mark(next, 0);
 	}
-	return rx;
 }
 
-int editor_row_rx_to_cx(erow *row, int rx) {
-	int cur_rx = 0;
-	int cx;
-	for (cx = 0; cx < row->size; cx++) {
-		if (row->chars[cx] == '\t')
-			cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
-		cur_rx++;
-		if (cur_rx > rx)
-			return cx;
+erow *editor_row_materialize(erow *span, int offset) {
+	int at = editor_row_index(span);
+	erow *prev = editor_row_prev(span);
+	int in_comment = prev ? prev->hl_open_comment : 0;
+	int clean = (span->hl_gen == e.hl_gen);
+	erow *a, *b, *c;
+	editor_row_split(e.root, at, &a, &b);
+	editor_row_split(b, span->lines, &b, &c);
+	int len;
+	char *s = editor_map_line(span->map_line + offset, &len);
+	erow *row = editor_new_node(1);
+	row->size = len;
+	row->chars = editor_slab_alloc(&row->cap, len + 1);
+	memcpy(row->chars, s, len);
+	row->chars[len] = '\0';
+	if (offset + 1 < span->lines) {
+		erow *right = editor_new_node(span->lines - offset - 1);
+		right->map_line = span->map_line + offset + 1;
+		right->hl_open_comment = span->hl_open_comment;
+		right->hl_gen = span->hl_gen;
+		right->hl_min = span->hl_gen;
+		c = editor_row_merge(right, c);
 	}
-	return cx;
+	if (offset > 0) {
+		span->lines = offset;
+		span->count = offset;
+		if (clean)
+			span->hl_open_comment = in_comment = editor_span_skim(span, in_comment);
+		a = editor_row_merge(a, span);
+	} else
+		editor_slab_free(span, sizeof(erow));
+	row->hl_gen = clean ? e.hl_gen : 0;
+	row->hl_min = row->hl_gen;
+	if (clean)
+		row->hl_open_comment = editor_syntax_skim(e.syntax, row->chars, row->size, in_comment);
+	editor_row_set_root(editor_row_merge(editor_row_merge(a, row), c));
+	return row;
 }
 
-void editor_update_row(erow *row) {
-	int tabs = 0;
-	int j;
-	for (j = 0; j < row->size; j++)
-		if (row->chars[j] == '\t')
-			tabs++;
-	free(row->render);
-	row->render = malloc(row->size + tabs * (KILO_TAB_STOP - 1) + 1);
-	int idx = 0;
-	for (j = 0; j < row->size; j++) {
-		if (row->chars[j] == '\t') {
-			row->render[idx++] = ' ';
-			while (idx % KILO_TAB_STOP != 0)
-				row->render[idx++] = ' ';
-		} else
-			row->render[idx++] = row->chars[j];
-	}
-	row->render[idx] = '\0';
-	row->rsize = idx;
-	editor_update_syntax(row);
+erow *editor_row_at(int at) {
+	int offset;
+	erow *row = editor_row_node(at, &offset);
+	if (row && row->chars == NULL)
+		row = editor_row_materialize(row, offset);
+	return row;
 }
 
 void editor_insert_row(int at, char *s, size_t len) {
 	if (at < 0 || at > e.numrows)
 		return;
-	e.row = realloc(e.row, sizeof(erow) * (e.numrows + 1));
-	memmove(&e.row[at + 1], &e.row[at], sizeof(erow) * (e.numrows - at));
-	for (int j = at + 1; j <= e.numrows; j++)
-		e.row[j].idx++;
-	e.row[at].idx = at;
-	e.row[at].size = len;
-	e.row[at].chars = malloc(len + 1);
-	memcpy(e.row[at].chars, s, len);
-	e.row[at].chars[len] = '\0';
-	e.row[at].rsize = 0;
-	e.row[at].render = NULL;
-	e.row[at].hl = NULL;
-	e.row[at].hl_open_comment = 0;
-	editor_update_row(&e.row[at]);
-	e.numrows++;
+	editor_row_at(at);
+	erow *row = editor_new_node(1);
+	row->size = len;
+	row->chars = editor_slab_alloc(&row->cap, len + 1);
+	memcpy(row->chars, s, len);
+	row->chars[len] = '\0';
+	erow *a, *b;
+	editor_row_split(e.root, at, &a, &b);
+	editor_row_set_root(editor_row_merge(editor_row_merge(a, row), b));
+	editor_update_row(row);
+	erow *next = editor_row_next(row);
+	if (next)
+		editor_syntax_mark(next, 0);
 	e.dirty++;
 }
 
 void editor_free_row(erow *row) {
-	free(row->render);
-	free(row->chars);
-	free(row->hl);
+	if (row->cache_slot >= 0)
+		e.cache[row->cache_slot] = NULL;
+	if (row->render != row->chars)
+		editor_slab_free(row->render, row->render_cap);
+	editor_slab_free(row->chars, row->cap);
+	free(row->wmap);
+	free(row->runs);
+	free(row->marks);
+}
+
+void editor_free_rows(erow *t) {
+	if (t == NULL)
+		return;
+	editor_free_rows(t->left);
+	editor_free_rows(t->right);
+	editor_free_row(t);
+}
+
+void editor_close() {
+	editor_find_stop();
+	editor_free_rows(e.root);
+	editor_row_set_root(NULL);
+	editor_map_free();
+	editor_slab_reset();
+	e.cx = e.cy = e.rx = 0;
+	e.rowoff = e.coloff = 0;
+	e.match_len = 0;
+	e.dirty = 0;
 }
 
 void editor_del_row(int at) {
 	if (at < 0 || at >= e.numrows)
 		return;
-	editor_free_row(&e.row[at]);
-	memmove(&e.row[at], &e.row[at + 1], sizeof(erow) * (e.numrows - at - 1));
-	for (int j = at; j < e.numrows - 1; j++)
-		e.row[j].idx--;
-	e.numrows--;
+	editor_row_at(at);
+	erow *a, *b, *c;
+	editor_row_split(e.root, at, &a, &b);
+	editor_row_split(b, 1, &b, &c);
+	editor_free_row(b);
+	editor_slab_free(b, sizeof(erow));
+	editor_row_set_root(editor_row_merge(a, c));
+	int offset;
+	erow *next = editor_row_node(at, &offset);
+	if (next)
+		editor_syntax_mark(next, 0);
 	e.dirty++;
 }
 
+void editor_row_reserve(erow *row, int need) {
+	int alias = row->render && row->render == row->chars;
+	row->chars = editor_slab_reserve(row->chars, &row->cap, need);
+	if (alias)
+		row->render = row->chars;
+}
+
 void editor_row_insert_char(erow *row, int at, int c) {
 	if (at < 0 || at > row->size)
 		at = row->size;
-	row->chars = realloc(row->chars, row->size + 2);
+	editor_row_reserve(row, row->size + 2);
 	memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
 	row->size++;
 	row->chars[at] = c;
-	editor_update_row(row);
+	editor_row_patch(row, at, NULL, 0, 1);
 	e.dirty++;
 }
 
 void editor_row_append_string(erow *row, char *s, size_t len) {
-	row->chars = realloc(row->chars, row->size + len + 1);
+	assert(row->chars != NULL);
+	editor_row_reserve(row, row->size + len + 1);
 	memcpy(&row->chars[row->size], s, len);
 	row->size += len;
 	row->chars[row->size] = '\0';
@@ -551,9 +3391,10 @@ void editor_row_append_string(erow *row, char *s, size_t len) {
 void editor_row_del_char(erow *row, int at) {
 	if (at < 0 || at >= row->size)
 		return;
+	char removed = row->chars[at];
 	memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
 	row->size--;
-	editor_update_row(row);
+	editor_row_patch(row, at, &removed, 1, 0);
 	e.dirty++;
 }
 
@@ -562,7 +3403,7 @@ void editor_row_del_char(erow *row, int at) {
 void editor_insert_char(int c) {
 	if (e.cy == e.numrows)
 		editor_insert_row(e.numrows, "", 0);
-	editor_row_insert_char(&e.row[e.cy], e.cx, c);
+	editor_row_insert_char(editor_row_at(e.cy), e.cx, c);
 	e.cx++;
 }
 
@@ -570,9 +3411,8 @@ void editor_insert_newline() {
 	if (e.cx == 0)
 		editor_insert_row(e.cy, "", 0);
 	else {
-		erow *row = &e.row[e.cy];
+		erow *row = editor_row_at(e.cy);
 		editor_insert_row(e.cy + 1, &row->chars[e.cx], row->size - e.cx);
-		row = &e.row[e.cy];
 		row->size = e.cx;
 		row->chars[row->size] = '\0';
 		editor_update_row(row);
@@ -581,18 +3421,66 @@ void editor_insert_newline() {
 	e.cx = 0;
 }
 
+void editor_insert_text(char *s, size_t len) {
+	if (e.cy == e.numrows)
+		editor_insert_row(e.numrows, "", 0);
+	erow *row = editor_row_at(e.cy);
+	int lines = 0;
+	for (size_t i = 0; i < len; i++)
+		if (s[i] == '\r' || s[i] == '\n')
+			lines++;
+	erow **rows = malloc(sizeof(erow *) * (lines + 1));
+	size_t tail_len = row->size - e.cx;
+	char *tail = malloc(tail_len + 1);
+	memcpy(tail, &row->chars[e.cx], tail_len);
+	row->size = e.cx;
+	erow *cur = row;
+	int n = 0;
+	size_t i = 0;
+	while (1) {
+		size_t start = i;
+		while (i < len && s[i] != '\r' && s[i] != '\n')
+			i++;
+		editor_row_append_string(cur, &s[start], i - start);
+		if (i == len)
+			break;
+		if (s[i] == '\r' && i + 1 < len && s[i + 1] == '\n')
+			i++;
+		i++;
+		cur = rows[n++] = editor_new_node(1);
+		cur->chars = editor_slab_alloc(&cur->cap, 1);
+		cur->chars[0] = '\0';
+	}
+	e.cx = cur->size;
+	editor_row_append_string(cur, tail, tail_len);
+	free(tail);
+	if (n > 0) {
+		erow *a, *b;
+		editor_row_split(e.root, e.cy + 1, &a, &b);
+		editor_row_set_root(editor_row_merge(editor_row_merge(a, editor_row_build(rows, n)), b));
+		e.cy += n;
+		erow *next = editor_row_next(cur);
+		if (next)
+			editor_syntax_mark(next, 0);
+	}
+	free(rows);
+}
+
 void editor_del_char() {
 	if (e.cy == e.numrows)
 		return;
 	if (e.cx == 0 && e.cy == 0)
 		return;
-	erow *row = &e.row[e.cy];
+	erow *row = editor_row_at(e.cy);
 	if (e.cx > 0) {
-		editor_row_del_char(row, e.cx - 1);
-		e.cx--;
+		int start = editor_utf8_start(row->chars, row->size, e.cx - 1);
+		for (int n = e.cx - start; n > 0; n--)
+			editor_row_del_char(row, start);
+		e.cx = start;
 	} else {
-		e.cx = e.row[e.cy - 1].size;
-		editor_row_append_string(&e.row[e.cy - 1], row->chars, row->size);
+		erow *prev = editor_row_at(e.cy - 1);
+		e.cx = prev->size;
+		editor_row_append_string(prev, row->chars, row->size);
 		editor_del_row(e.cy);
 		e.cy--;
 	}
@@ -600,127 +3488,511 @@ void editor_del_char() {
 
 /* file i/o */
 
-char *editor_rows_to_string(int *buflen) {
-	int totlen = 0;
+char *editor_rows_to_string(size_t *buflen, size_t *lines) {
+	size_t totlen = 0;
+	erow *row;
+	int len;
 	int j;
-	for (j = 0; j < e.numrows; j++)
-		totlen += e.row[j].size + 1;
+	for (row = editor_row_first(); row; row = editor_row_next(row))
+		for (j = 0; j < row->lines; j++) {
+			len = row->size;
+			if (row->chars == NULL)
+				editor_map_line(row->map_line + j, &len);
+			totlen += len + 1;
+		}
 	*buflen = totlen;
 	char *buf = malloc(totlen);
 	char *p = buf;
-	for (j = 0; j < e.numrows; j++) {
-		memcpy(p, e.row[j].chars, e.row[j].size);
-		p += e.row[j].size;
-		*p = '\n';
-		p++;
-	}
+	for (row = editor_row_first(); row; row = editor_row_next(row))
+		for (j = 0; j < row->lines; j++) {
+			char *s = row->chars;
+			len = row->size;
+			if (s == NULL)
+				s = editor_map_line(row->map_line + j, &len);
+			if (lines)
+				*lines++ = p - buf;
+			memcpy(p, s, len);
+			p += len;
+			*p = '\n';
+			p++;
+		}
+	if (lines)
+		*lines = p - buf;
 	return buf;
 }
 
+int editor_write(int fd, char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
 void editor_open(char *filename) {
+	editor_close();
 	free(e.filename);
 	e.filename = strdup(filename);
 	editor_select_syntax_highlight();
 	FILE *fp = fopen(filename, "r");
 	if (!fp)
 		die_cur("fopen");
-	char *line = NULL;
-	size_t linecap = 0;
-	ssize_t linelen;
-	while ((linelen = getline(&line, &linecap, fp)) != -1) {
-		while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-			linelen--;
-		editor_insert_row(e.numrows, line, linelen);
-	}
-	free(line);
+	if (editor_map_open(fp) == -1) {
+		char *line = NULL;
+		size_t linecap = 0;
+		ssize_t linelen;
+		while ((linelen = getline(&line, &linecap, fp)) != -1) {
+			while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+				linelen--;
+			editor_insert_row(e.numrows, line, linelen);
+		}
+		free(line);
+	}
 	fclose(fp);
 	e.dirty = 0;
 }
 
 void editor_save() {
 	if (e.filename == NULL) {
-		e.filename = editor_prompt("Save as: %s (ESC to cancel)", NULL);
+		e.filename = editor_prompt("Save as: %s (ESC to cancel)", NULL, 0);
 		if (e.filename == NULL) {
 			editor_set_status_message("Save aborted");
 			return;
 		}
 		editor_select_syntax_highlight();
 	}
-	int len;
-	char *buf = editor_rows_to_string(&len);
+	size_t len;
+	size_t *lines = e.map ? malloc((e.numrows + 1) * sizeof(size_t)) : NULL;
+	char *buf = editor_rows_to_string(&len, lines);
 	int fd = open(e.filename, O_RDWR | O_CREAT, 0644);
 	if (fd != -1) {
-		if (ftruncate(fd, len) != -1)
-			if (write(fd, buf, len) == len) {
-				close(fd);
+		if (ftruncate(fd, len) != -1 && editor_write(fd, buf, len) != -1) {
+			char *map = lines ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+			if (map != MAP_FAILED) {
+				editor_map_rebind(map, len, lines, 0);
 				free(buf);
-				e.dirty = 0;
-				editor_set_status_message("%d bytes written to disk", len);
-				return;
-			}
+			} else if (lines)
+				editor_map_rebind(buf, len, lines, 1);
+			else
+				free(buf);
+			close(fd);
+			e.dirty = 0;
+			editor_set_status_message("%zu bytes written to disk", len);
+			return;
+		}
+		if (lines) {
+			editor_map_rebind(buf, len, lines, 1);
+			buf = NULL;
+			lines = NULL;
+		}
 		close(fd);
 	}
+	free(lines);
 	free(buf);
 	editor_set_status_message("Can't save! I/O error: %s", strerror(errno));
 }
 
 /* find */
 
+int editor_find_line(int line, int *match_len) {
+	int offset, len, at;
+	erow *row = editor_row_node(line, &offset);
+	char *text = row->chars ? row->chars : editor_map_line(row->map_line + offset, &len);
+	if (row->chars)
+		len = row->size;
+	if (e.find_regex) {
+		at = editor_regex_locate(&e.regex, text, len, 0, match_len);
+		*match_len -= at;
+		return at;
+	}
+	*match_len = e.needle.len;
+	return e.search(&e.needle, text, len, &at, 1) ? at : -1;
+}
+
+int editor_find_test(struct dfa *d, const char *text, int len) {
+	int at;
+	if (e.find_regex)
+		return editor_dfa_test(d, text, len);
+	return e.search(&e.needle, text, len, &at, 1);
+}
+
+void editor_find_reset(int origin) {
+	e.find_count = 0;
+	e.find_scanned = 0;
+	e.find_pos = -1;
+	e.find_origin = origin;
+	free(e.find_query);
+	e.find_query = NULL;
+	e.find_query_len = 0;
+}
+
+void editor_find_push(int **lines, int *count, int *cap, int line) {
+	if (*count == *cap) {
+		*cap = *cap ? *cap * 2 : 64;
+		*lines = realloc(*lines, sizeof(int) * *cap);
+	}
+	(*lines)[(*count)++] = line;
+}
+
+int editor_find_block(struct dfa *d, const char *text, const size_t *starts, int first, int lines, int all, int **out, int *count, int *cap) {
+	if (e.find_regex) {
+		for (int k = 0; k < lines; k++) {
+			size_t end = starts[k + 1];
+			while (end > starts[k] && (text[end - 1] == '\n' || text[end - 1] == '\r'))
+				end--;
+			if (editor_dfa_test(d, &text[starts[k]], end - starts[k])) {
+				editor_find_push(out, count, cap, first + k);
+				if (!all)
+					return k + 1;
+			}
+		}
+		return lines;
+	}
+	int hits[KILO_FIND_HITS];
+	size_t base = starts[0];
+	int len = starts[lines] - base;
+	int pos = 0, line = -1, n;
+	do {
+		n = e.search(&e.needle, &text[base + pos], len - pos, hits, all ? KILO_FIND_HITS : 1);
+		for (int k = 0; k < n; k++) {
+			size_t at = base + pos + hits[k];
+			if (line >= 0 && at < starts[line + 1])
+				continue;
+			while (starts[line + 1] <= at)
+				line++;
+			editor_find_push(out, count, cap, first + line);
+			if (!all)
+				return line + 1;
+		}
+		if (n)
+			pos = starts[line + 1] - base;
+	} while (n == KILO_FIND_HITS && pos < len);
+	return lines;
+}
+
+int editor_find_scan(int all) {
+	int first = e.find_count;
+	while (e.find_scanned < e.numrows && (all || e.find_count == first)) {
+		int line = (e.find_origin + e.find_scanned) % e.numrows;
+		int offset;
+		erow *row = editor_row_node(line, &offset);
+		if (row->chars) {
+			if (editor_find_test(&e.find_dfa, row->chars, row->size))
+				editor_find_push(&e.find_lines, &e.find_count, &e.find_cap, line);
+			e.find_scanned++;
+			continue;
+		}
+		int lines = row->lines - offset;
+		if (lines > e.numrows - e.find_scanned)
+			lines = e.numrows - e.find_scanned;
+		e.find_scanned += editor_find_block(&e.find_dfa, e.map, &e.map_lines[row->map_line + offset], line, lines, all, &e.find_lines, &e.find_count, &e.find_cap);
+	}
+	return e.find_count > first ? first : -1;
+}
+
+void editor_find_narrow() {
+	int kept = 0, len;
+	for (int i = 0; i < e.find_count; i++)
+		if (editor_find_line(e.find_lines[i], &len) >= 0)
+			e.find_lines[kept++] = e.find_lines[i];
+	e.find_count = kept;
+}
+
+void editor_find_parts() {
+	int line = 0;
+	e.find_part_count = 0;
+	for (erow *row = editor_row_first(); row; row = editor_row_next(row)) {
+		if (e.find_part_count == e.find_part_cap) {
+			e.find_part_cap = e.find_part_cap ? e.find_part_cap * 2 : 64;
+			e.find_parts = realloc(e.find_parts, sizeof(struct find_part) * e.find_part_cap);
+		}
+		struct find_part *p = &e.find_parts[e.find_part_count++];
+		p->line = line;
+		if (row->chars) {
+			p->text = row->chars;
+			p->starts = NULL;
+			p->len = row->size;
+		} else {
+			p->text = e.map;
+			p->starts = &e.map_lines[row->map_line];
+			p->len = row->lines;
+		}
+		line += row->lines;
+	}
+}
+
+void editor_find_plan() {
+	int n = e.find_source ? e.find_source_count : e.find_part_count;
+	int part = 0, size = 0;
+	e.find_batch_count = 0;
+	for (int i = 0; i < n; i++) {
+		struct find_part *p;
+		if (e.find_source) {
+			p = &e.find_parts[part];
+			while (p->line + (p->starts ? p->len : 1) <= e.find_source[i])
+				p = &e.find_parts[++part];
+		} else
+			p = &e.find_parts[part = i];
+		if (e.find_batch_count == 0 || size >= (e.find_source ? KILO_FIND_NARROW : KILO_FIND_BATCH)) {
+			if (e.find_batch_count == e.find_batch_cap) {
+				e.find_batch_cap = e.find_batch_cap ? e.find_batch_cap * 2 : 16;
+				e.find_batches = realloc(e.find_batches, sizeof(struct find_batch) * e.find_batch_cap);
+			}
+			struct find_batch *b = &e.find_batches[e.find_batch_count++];
+			b->first = i;
+			b->count = 0;
+			b->part = part;
+			b->lines = NULL;
+			b->n = b->cap = 0;
+			b->done = 0;
+			size = 0;
+		}
+		e.find_batches[e.find_batch_count - 1].count++;
+		if (e.find_source)
+			size++;
+		else
+			size += p->starts ? (int)(p->starts[p->len] - p->starts[0]) : p->len + 1;
+	}
+}
+
+void editor_find_filter(struct dfa *d, struct find_batch *b) {
+	struct find_part *p = &e.find_parts[b->part];
+	int end = b->first + b->count;
+	for (int i = b->first; i < end && !__atomic_load_n(&e.find_cancel, __ATOMIC_RELAXED);) {
+		int line = e.find_source[i];
+		while (p->line + (p->starts ? p->len : 1) <= line)
+			p++;
+		if (p->starts == NULL) {
+			if (editor_find_test(d, p->text, p->len))
+				editor_find_push(&b->lines, &b->n, &b->cap, line);
+			i++;
+			continue;
+		}
+		int run = 1;
+		while (i + run < end && e.find_source[i + run] == line + run && line + run < p->line + p->len)
+			run++;
+		editor_find_block(d, p->text, &p->starts[line - p->line], line, run, 1, &b->lines, &b->n, &b->cap);
+		i += run;
+	}
+}
+
+void editor_find_scan_parts(struct dfa *d, struct find_batch *b) {
+	for (int i = b->first; i < b->first + b->count && !__atomic_load_n(&e.find_cancel, __ATOMIC_RELAXED); i++) {
+		struct find_part *p = &e.find_parts[i];
+		if (p->starts)
+			editor_find_block(d, p->text, p->starts, p->line, p->len, 1, &b->lines, &b->n, &b->cap);
+		else if (editor_find_test(d, p->text, p->len))
+			editor_find_push(&b->lines, &b->n, &b->cap, p->line);
+	}
+}
+
+void *editor_find_worker(void *arg) {
+	struct dfa d = {0};
+	int gen = -1;
+	(void)arg;
+	pthread_mutex_lock(&e.find_lock);
+	for (;;) {
+		while (__atomic_load_n(&e.find_cancel, __ATOMIC_RELAXED) || e.find_next == e.find_batch_count)
+			pthread_cond_wait(&e.find_cond, &e.find_lock);
+		struct find_batch *b = &e.find_batches[e.find_next++];
+		e.find_busy++;
+		if (gen != e.find_gen) {
+			gen = e.find_gen;
+			editor_dfa_free(&d);
+			if (e.find_regex)
+				editor_dfa_init(&d, &e.regex);
+		}
+		pthread_mutex_unlock(&e.find_lock);
+		if (e.find_source)
+			editor_find_filter(&d, b);
+		else
+			editor_find_scan_parts(&d, b);
+		uint64_t one = 1;
+		pthread_mutex_lock(&e.find_lock);
+		b->done = 1;
+		e.find_found += b->n;
+		if (--e.find_busy == 0)
+			pthread_cond_signal(&e.find_idle);
+		write(e.hl_event, &one, sizeof(one));
+	}
+	return NULL;
+}
+
+void editor_find_start() {
+	if (e.find_parts == NULL)
+		editor_find_parts();
+	pthread_mutex_lock(&e.find_lock);
+	editor_find_plan();
+	e.find_next = 0;
+	e.find_gen++;
+	e.find_running = 1;
+	__atomic_store_n(&e.find_cancel, 0, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&e.find_cond);
+	pthread_mutex_unlock(&e.find_lock);
+	for (; e.find_workers < e.hl_threads; e.find_workers++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, editor_find_worker, NULL) != 0)
+			die_last("pthread_create");
+	}
+}
+
+void editor_find_stop() {
+	pthread_mutex_lock(&e.find_lock);
+	__atomic_store_n(&e.find_cancel, 1, __ATOMIC_RELAXED);
+	while (e.find_busy)
+		pthread_cond_wait(&e.find_idle, &e.find_lock);
+	pthread_mutex_unlock(&e.find_lock);
+	e.find_running = 0;
+	for (int k = 0; k < e.find_batch_count; k++) {
+		struct find_batch *b = &e.find_batches[k];
+		free(b->lines);
+		b->lines = NULL;
+		b->n = b->cap = 0;
+		b->done = 0;
+	}
+	e.find_found = 0;
+	e.find_index_count = 0;
+	e.find_merged = 0;
+}
+
+void editor_find_source(int count) {
+	free(e.find_source);
+	e.find_source = NULL;
+	e.find_source_count = 0;
+	if (count < 0)
+		return;
+	e.find_source = e.find_index;
+	e.find_source_count = count;
+	e.find_index = NULL;
+	e.find_index_cap = 0;
+}
+
+int editor_find_collect() {
+	pthread_mutex_lock(&e.find_lock);
+	while (e.find_merged < e.find_batch_count && e.find_batches[e.find_merged].done) {
+		struct find_batch *b = &e.find_batches[e.find_merged++];
+		for (int k = 0; k < b->n; k++)
+			editor_find_push(&e.find_index, &e.find_index_count, &e.find_index_cap, b->lines[k]);
+		free(b->lines);
+		b->lines = NULL;
+		b->n = b->cap = 0;
+	}
+	e.find_total = e.find_found;
+	pthread_mutex_unlock(&e.find_lock);
+	return e.find_running && e.find_merged == e.find_batch_count;
+}
+
+int editor_find_bound(int line) {
+	int lo = 0, hi = e.find_index_count;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (e.find_index[mid] < line)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+int editor_find_step(int line, int dir) {
+	int k = editor_find_bound(dir > 0 ? line + 1 : line);
+	if (dir > 0)
+		return e.find_index[k < e.find_index_count ? k : 0];
+	return e.find_index[k > 0 ? k - 1 : e.find_index_count - 1];
+}
+
 void editor_find_callback(char *query, int key) {
-	static int last_match = -1;
-	static int direction = 1;
-	static int saved_hl_line;
-	static char *saved_hl = NULL;
-	if (saved_hl) {
-		memcpy(e.row[saved_hl_line].hl, saved_hl, e.row[saved_hl_line].rsize);
-		free(saved_hl);
-		saved_hl = NULL;
-	}
-	if (key == '\r' || key == '\x1b') {
-		last_match = -1;
-		direction = 1;
+	int len = strlen(query);
+	if (key != '\r' && key != '\x1b' && editor_utf8_partial(query, len))
+		return;
+	e.match_len = 0;
+	if (key == '\r' || key == '\x1b')
+		return;
+	if (len == 0 || e.numrows == 0) {
+		editor_find_stop();
+		editor_find_reset(e.cy);
+		e.find_error = NULL;
 		return;
 	}
-	else if (key == ARROW_RIGHT || key == ARROW_DOWN)
-		direction = 1;
-	else if (key == ARROW_LEFT || key == ARROW_UP)
-		direction = -1;
-	else {
-		last_match = -1;
-		direction = 1;
-	}
-	if (last_match == -1)
-		direction = 1;
-	int current = last_match;
-	int i;
-	for (i = 0; i < e.numrows; i++) {
-		current += direction;
-		if (current == -1)
-			current = e.numrows - 1;
-		else if (current == e.numrows)
-			current = 0;
-		erow *row = &e.row[current];
-		char *match = strstr(row->render, query);
-		if (match) {
-			last_match = current;
-			e.cy = current;
-			e.cx = editor_row_rx_to_cx(row, match - row->render);
-			e.rowoff = e.numrows;
-			saved_hl_line = current;
-			saved_hl = malloc(row->rsize);
-			memcpy(saved_hl, row->hl, row->rsize);
-			memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-			break;
-		}
+	int pos = e.find_pos;
+	int line = -1;
+	int arrow = (key == ARROW_RIGHT || key == ARROW_DOWN) ? 1 : (key == ARROW_LEFT || key == ARROW_UP) ? -1 : 0;
+	if (arrow && e.find_line >= 0 && editor_find_collect()) {
+		if (e.find_index_count)
+			line = editor_find_step(e.find_line, arrow);
+	} else if (arrow > 0) {
+		if (pos + 1 < e.find_count)
+			pos++;
+		else if ((pos = editor_find_scan(0)) < 0 && e.find_count)
+			pos = 0;
+	} else if (arrow < 0) {
+		if (pos <= 0)
+			editor_find_scan(1);
+		pos = (pos > 0 ? pos : e.find_count) - 1;
+	} else if (!e.find_query || len != e.find_query_len || strcmp(query, e.find_query)) {
+		int narrow = !e.find_regex && e.find_query && len > e.find_query_len && !strncmp(query, e.find_query, e.find_query_len);
+		/* filtering visits lines one by one, so only reuse a sparse index */
+		int kept = (narrow && editor_find_collect() && e.find_index_count < e.numrows / 8) ? e.find_index_count : -1;
+		editor_find_stop();
+		editor_find_source(kept);
+		if (!narrow)
+			editor_find_reset(e.cy);
+		e.find_line = -1;
+		if (e.find_regex) {
+			editor_dfa_free(&e.find_dfa);
+			e.find_error = editor_regex_compile(&e.regex, query, len);
+			if (!e.find_error)
+				editor_dfa_init(&e.find_dfa, &e.regex);
+		} else
+			editor_needle_compile(&e.needle, query, len);
+		if (e.find_error)
+			e.find_scanned = e.numrows;
+		else
+			editor_find_start();
+		if (narrow)
+			editor_find_narrow();
+		pos = e.find_count ? 0 : editor_find_scan(0);
+		free(e.find_query);
+		e.find_query = strdup(query);
+		e.find_query_len = len;
 	}
+	e.find_pos = pos;
+	if (line < 0 && pos >= 0)
+		line = e.find_lines[pos];
+	if (line < 0)
+		return;
+	int at = editor_find_line(line, &len);
+	e.find_line = line;
+	e.cy = line;
+	e.cx = at;
+	e.rowoff = e.numrows;
+	e.match_line = line;
+	e.match_at = at;
+	e.match_len = len;
 }
 
-void editor_find() {
+void editor_find(int regex) {
 	int saved_cx = e.cx;
 	int saved_cy = e.cy;
 	int saved_coloff = e.coloff;
 	int saved_rowoff = e.rowoff;
-	char *query = editor_prompt("Search: %s (Use ESC/Arrows/Enter)", editor_find_callback);
+	editor_find_reset(e.cy);
+	e.find_line = -1;
+	e.find_active = 1;
+	e.find_regex = regex;
+	e.find_error = NULL;
+	char *query = editor_prompt(regex ? "Regex: %s (Use ESC/Arrows/Enter)" : "Search: %s (Use ESC/Arrows/Enter)", editor_find_callback, 0);
+	editor_find_stop();
+	editor_find_source(-1);
+	free(e.find_parts);
+	e.find_parts = NULL;
+	e.find_part_cap = 0;
+	editor_dfa_free(&e.find_dfa);
+	e.find_active = 0;
+	e.find_regex = 0;
 	if (query)
 		free(query);
 	else {
@@ -731,26 +4003,110 @@ void editor_find() {
 	}
 }
 
-/* append buffer */
+/* replace */
 
-struct abuf {
-	char *b;
-	int len;
-};
+int editor_replace_row(erow *row, const char *with, int len, int **hits, int *cap) {
+	int found[KILO_FIND_HITS];
+	int count = 0, pos = 0, end = 0, n;
+	do {
+		n = e.search(&e.needle, &row->chars[pos], row->size - pos, found, KILO_FIND_HITS);
+		for (int k = 0; k < n; k++)
+			if (pos + found[k] >= end) {
+				editor_find_push(hits, &count, cap, pos + found[k]);
+				end = pos + found[k] + e.needle.len;
+			}
+		if (n)
+			pos += found[n - 1] + 1;
+	} while (n == KILO_FIND_HITS);
+	if (count == 0)
+		return 0;
+	int size = row->size + count * (len - e.needle.len);
+	int chars_cap;
+	char *chars = editor_slab_alloc(&chars_cap, size + 1);
+	int from = 0, to = 0;
+	for (int k = 0; k < count; k++) {
+		int at = (*hits)[k];
+		memcpy(&chars[to], &row->chars[from], at - from);
+		to += at - from;
+		memcpy(&chars[to], with, len);
+		to += len;
+		from = at + e.needle.len;
+	}
+	memcpy(&chars[to], &row->chars[from], row->size - from);
+	chars[size] = '\0';
+	if (row->render == row->chars)
+		row->render = chars;
+	editor_slab_free(row->chars, row->cap);
+	row->chars = chars;
+	row->cap = chars_cap;
+	row->size = size;
+	editor_update_row(row);
+	return count;
+}
+
+void editor_replace() {
+	char *query = editor_prompt("Replace: %s (ESC to cancel)", NULL, 0);
+	if (query == NULL)
+		return;
+	char *with = editor_prompt("Replace with: %s (ESC to cancel)", NULL, 1);
+	if (with == NULL) {
+		free(query);
+		return;
+	}
+	editor_needle_compile(&e.needle, query, strlen(query));
+	int *lines = NULL, count = 0, cap = 0;
+	int line = 0, at;
+	for (erow *row = editor_row_first(); row; row = editor_row_next(row)) {
+		if (row->chars == NULL)
+			editor_find_block(NULL, e.map, &e.map_lines[row->map_line], line, row->lines, 1, &lines, &count, &cap);
+		else if (e.search(&e.needle, row->chars, row->size, &at, 1))
+			editor_find_push(&lines, &count, &cap, line);
+		line += row->lines;
+	}
+	int *hits = NULL, hits_cap = 0, total = 0;
+	int len = strlen(with);
+	for (int k = 0; k < count; k++)
+		total += editor_replace_row(editor_row_at(lines[k]), with, len, &hits, &hits_cap);
+	if (total)
+		e.dirty++;
+	if (e.cy < e.numrows) {
+		erow *row = editor_row_at(e.cy);
+		if (e.cx > row->size)
+			e.cx = row->size;
+		e.cx = editor_utf8_start(row->chars, row->size, e.cx);
+	}
+	editor_set_status_message("Replaced %d occurrences on %d lines", total, count);
+	free(hits);
+	free(lines);
+	free(with);
+	free(query);
+}
 
-#define ABUF_INIT {NULL, 0}
+/* append buffer */
 
 void ab_append(struct abuf *ab, const char *s, int len) {
-	char *new = realloc(ab->b, ab->len + len);
-	if (new == NULL)
-		return;
-	memcpy(&new[ab->len], s, len);
-	ab->b = new;
+	if (ab->len + len > ab->cap) {
+		int cap = ab->cap ? ab->cap : 4096;
+		while (cap < ab->len + len)
+			cap *= 2;
+		char *new = realloc(ab->b, cap);
+		if (new == NULL)
+			return;
+		ab->b = new;
+		ab->cap = cap;
+	}
+	memcpy(&ab->b[ab->len], s, len);
 	ab->len += len;
 }
 
-void ab_free(struct abuf *ab) {
-	free(ab->b);
+void ab_append_int(struct abuf *ab, int n) {
+	char buf[12];
+	int i = sizeof(buf);
+	do {
+		buf[--i] = '0' + n % 10;
+		n /= 10;
+	} while (n);
+	ab_append(ab, &buf[i], sizeof(buf) - i);
 }
 
 /* output */
@@ -758,7 +4114,7 @@ void ab_free(struct abuf *ab) {
 void editor_scroll() {
 	e.rx = 0;
 	if (e.cy < e.numrows)
-		e.rx = editor_row_cx_to_rx(&e.row[e.cy], e.cx);
+		e.rx = editor_row_cx_to_rx(editor_row_at(e.cy), e.cx);
 	if (e.cy < e.rowoff)
 		e.rowoff = e.cy;
 	if (e.cy >= e.rowoff + e.screenrows)
@@ -769,103 +4125,416 @@ void editor_scroll() {
 		e.coloff = e.rx - e.screencols + 1;
 }
 
-void editor_draw_rows(struct abuf *ab) {
+void editor_alloc_screen() {
+	int cells = (e.screenrows + 2) * e.screencols;
+	e.screen = realloc(e.screen, cells * sizeof(struct cell));
+	e.shadow = realloc(e.shadow, cells * sizeof(struct cell));
+	e.shadow_valid = 0;
+}
+
+void editor_draw_cell(int y, int x, char c, int attr) {
+	e.screen[y * e.screencols + x] = (struct cell){{c}, 1, attr};
+}
+
+void editor_draw_glyph(int y, int x, const char *s, int n, int attr) {
+	struct cell *cell = &e.screen[y * e.screencols + x];
+	memset(cell->c, 0, sizeof(cell->c));
+	memcpy(cell->c, s, n);
+	cell->len = n;
+	cell->attr = attr;
+}
+
+int editor_draw_unit(int y, int x, const char *s, int n, int width, int attr) {
+	if (width == 0) {
+		if (x == 0)
+			return x;
+		struct cell *cell = &e.screen[y * e.screencols + x - 1];
+		if (cell->len == 0 && x >= 2)
+			cell--;
+		if (cell->len + n <= (int)sizeof(cell->c)) {
+			memcpy(&cell->c[cell->len], s, n);
+			cell->len += n;
+		}
+		return x;
+	}
+	if (width == 2) {
+		if (x + 1 >= e.screencols) {
+			editor_draw_cell(y, x, ' ', CELL_DEFAULT);
+			return x + 1;
+		}
+		editor_draw_glyph(y, x, s, n, attr);
+		editor_draw_glyph(y, x + 1, s, 0, attr);
+		return x + 2;
+	}
+	editor_draw_glyph(y, x, s, n, attr);
+	return x + 1;
+}
+
+int editor_draw_text(int y, int x, const char *s, int len, int attr) {
+	int i = 0;
+	while (i < len && x < e.screencols) {
+		int cp;
+		int n = editor_utf8_decode(&s[i], len - i, &cp);
+		if (cp < 0)
+			editor_draw_cell(y, x++, '?', attr);
+		else if (cp < 0x80)
+			editor_draw_cell(y, x++, s[i], attr);
+		else
+			x = editor_draw_unit(y, x, &s[i], n, editor_char_width(cp), attr);
+		i += n;
+	}
+	return x;
+}
+
+int editor_draw_row_utf8(int y, erow *row) {
+	int rb, rx;
+	editor_row_locate(row, editor_row_rx_to_cx(row, e.coloff), &rb, &rx);
+	int k = 0, end = 0;
+	if (rb < row->rsize) {
+		k = editor_hl_seek(row, rb, &end);
+		end += row->runs[k].len;
+	}
+	int x = 0;
+	while (rb < row->rsize && rx < e.coloff) {
+		int w = row->wmap[rb] & WMAP_WIDTH;
+		if (rx + w > e.coloff)
+			editor_draw_cell(y, x++, ' ', CELL_DEFAULT);
+		rx += w;
+		for (rb++; rb < row->rsize && (row->wmap[rb] & WMAP_CONT); rb++)
+			;
+	}
+	int current_color = CELL_DEFAULT;
+	while (rb < row->rsize && x < e.screencols) {
+		char *c = &row->render[rb];
+		int w = row->wmap[rb];
+		int n = 1;
+		while (rb + n < row->rsize && (row->wmap[rb + n] & WMAP_CONT))
+			n++;
+		if (w & WMAP_BAD)
+			editor_draw_cell(y, x++, '?', current_color | CELL_REVERSE);
+		else if (n == 1 && (row->scan & SCAN_CTRL) && iscntrl(*c))
+			editor_draw_cell(y, x++, (*c <= 26) ? '@' + *c : '?', current_color | CELL_REVERSE);
+		else {
+			while (end <= rb)
+				end += row->runs[++k].len;
+			if (row->runs[k].hl == HL_NORMAL)
+				current_color = CELL_DEFAULT;
+			else
+				current_color = editor_syntax_to_color(row->runs[k].hl);
+			x = editor_draw_unit(y, x, c, n, w & WMAP_WIDTH, current_color);
+		}
+		rb += n;
+	}
+	return x;
+}
+
+int editor_draw_row_runs(int y, erow *row, int len) {
+	char *c = &row->render[e.coloff];
+	int current_color = CELL_DEFAULT;
+	int ctrl = row->scan & SCAN_CTRL;
+	int x = 0;
+	int k = 0, end = 0;
+	if (len) {
+		k = editor_hl_seek(row, e.coloff, &end);
+		end += row->runs[k].len;
+	}
+	while (x < len) {
+		int color = (row->runs[k].hl == HL_NORMAL) ? CELL_DEFAULT : editor_syntax_to_color(row->runs[k].hl);
+		int stop = end - e.coloff;
+		if (stop > len)
+			stop = len;
+		if (!ctrl) {
+			for (; x < stop; x++)
+				editor_draw_cell(y, x, c[x], color);
+			current_color = color;
+		} else
+			for (; x < stop; x++) {
+				if (iscntrl(c[x]))
+					editor_draw_cell(y, x, (c[x] <= 26) ? '@' + c[x] : '?', current_color | CELL_REVERSE);
+				else {
+					current_color = color;
+					editor_draw_cell(y, x, c[x], color);
+				}
+			}
+		if (x < len)
+			end += row->runs[++k].len;
+	}
+	return x;
+}
+
+void editor_draw_match(int y, erow *row) {
+	int from = editor_row_cx_to_rx(row, e.match_at) - e.coloff;
+	int to = editor_row_cx_to_rx(row, e.match_at + e.match_len) - e.coloff;
+	if (from < 0)
+		from = 0;
+	if (to > e.screencols)
+		to = e.screencols;
+	for (int x = from; x < to; x++)
+		e.screen[y * e.screencols + x].attr = editor_syntax_to_color(HL_MATCH);
+}
+
+void editor_clear_line(int y, int x) {
+	for (; x < e.screencols; x++)
+		editor_draw_cell(y, x, ' ', CELL_DEFAULT);
+}
+
+void editor_draw_rows() {
 	int y;
 	for (y = 0; y < e.screenrows; y++) {
-		int filerow = y + e.rowoff;
-		if (filerow >= e.numrows) {
-			ab_append(ab, "\x1b[94m", 5);
-			ab_append(ab, "~", 1);
-			ab_append(ab, "\x1b[39m", 5);
-		} else {
-			int len = e.row[filerow].rsize - e.coloff;
-			if (len < 0)
-				len = 0;
-			if (len > e.screencols)
-				len = e.screencols;
-			char *c = &e.row[filerow].render[e.coloff];
-			unsigned char *hl = &e.row[filerow].hl[e.coloff];
-			int current_color = -1;
-			int j;
-			for (j = 0; j < len; j++) {
-				if (iscntrl(c[j])) {
-					char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-					ab_append(ab, "\x1b[7m", 4);
-					ab_append(ab, &sym, 1);
-					ab_append(ab, "\x1b[m", 3);
-					if (current_color != -1) {
-						char buf[16];
-						int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-						ab_append(ab, buf, clen);
-					}
-				} else if (hl[j] == HL_NORMAL) {
-					if (current_color != -1) {
-						ab_append(ab, "\x1b[39m", 5);
-						current_color = -1;
-					}
-					ab_append(ab, &c[j], 1);
-				} else {
-					int color = editor_syntax_to_color(hl[j]);
-					if (color != current_color) {
-						current_color = color;
-						char buf[16];
-						int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-						ab_append(ab, buf, clen);
-					}
-					ab_append(ab, &c[j], 1);
-				}
+		erow *row = editor_row_at(y + e.rowoff);
+		int x = 0;
+		if (row == NULL)
+			editor_draw_cell(y, x++, '~', 94);
+		else {
+			editor_row_prepare(row);
+			if (row->wmap)
+				x = editor_draw_row_utf8(y, row);
+			else {
+				int len = row->rsize - e.coloff;
+				if (len < 0)
+					len = 0;
+				if (len > e.screencols)
+					len = e.screencols;
+				x = editor_draw_row_runs(y, row, len);
 			}
-			ab_append(ab, "\x1b[39m", 5);
+			if (e.match_len && y + e.rowoff == e.match_line)
+				editor_draw_match(y, row);
 		}
-		ab_append(ab, "\x1b[K", 3);
-		ab_append(ab, "\r\n", 2);
+		editor_clear_line(y, x);
+	}
+	for (y = 1; y <= KILO_PREFETCH_ROWS; y++) {
+		erow *row = editor_row_at(e.rowoff + e.screenrows - 1 + y);
+		if (row)
+			editor_row_prepare(row);
+		if (e.rowoff - y >= 0)
+			editor_row_prepare(editor_row_at(e.rowoff - y));
 	}
 }
 
-void editor_draw_status_bar(struct abuf *ab) {
-	ab_append(ab, "\x1b[7m", 4);
+void editor_draw_status_bar() {
 	char status[80], rstatus[80];
 	int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", e.filename ? e.filename : "[No Name]", e.numrows, e.dirty ? "(modified)" : "");
 	int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d", e.syntax ? e.syntax->filetype : "no ft", e.cy + 1, e.numrows);
-	if (len > e.screencols)
-		len = e.screencols;
-	ab_append(ab, status, len);
-	while (len < e.screencols) {
-		if (e.screencols - len == rlen) {
-			ab_append(ab, rstatus, rlen);
+	if (e.find_active && e.find_error && len < (int)sizeof(status))
+		len += snprintf(&status[len], sizeof(status) - len, " | bad regex: %s", e.find_error);
+	if (e.find_active && e.find_running && len < (int)sizeof(status)) {
+		int done = editor_find_collect();
+		int k = editor_find_bound(e.find_line);
+		int found = (e.find_line >= 0 && k < e.find_index_count && e.find_index[k] == e.find_line);
+		if (done && e.find_index_count == 0)
+			len += snprintf(&status[len], sizeof(status) - len, " | no matches");
+		else if (found)
+			len += snprintf(&status[len], sizeof(status) - len, " | line %d of %d%s", k + 1, e.find_total, done ? "" : "+");
+		else
+			len += snprintf(&status[len], sizeof(status) - len, " | line ? of %d%s", e.find_total, done ? "" : "+");
+	}
+	if (len > (int)sizeof(status) - 1)
+		len = sizeof(status) - 1;
+	int x = editor_draw_text(e.screenrows, 0, status, len, CELL_DEFAULT | CELL_REVERSE);
+	for (; x < e.screencols; x++) {
+		if (e.screencols - x == rlen) {
+			for (int j = 0; j < rlen; j++)
+				editor_draw_cell(e.screenrows, x + j, rstatus[j], CELL_DEFAULT | CELL_REVERSE);
 			break;
-		} else {
-			ab_append(ab, " ", 1);
-			len++;
 		}
+		editor_draw_cell(e.screenrows, x, ' ', CELL_DEFAULT | CELL_REVERSE);
 	}
-	ab_append(ab, "\x1b[m", 3);
-	ab_append(ab, "\r\n", 2);
 }
 
-void editor_draw_message_bar(struct abuf *ab) {
-	ab_append(ab, "\x1b[K", 3);
+void editor_draw_message_bar() {
 	int msglen = strlen(e.statusmsg);
-	if (msglen > e.screencols)
-		msglen = e.screencols;
-	if (msglen && time(NULL) - e.statusmsg_time < 5)
-		ab_append(ab, e.statusmsg, msglen);
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (now.tv_sec - e.statusmsg_time >= KILO_MESSAGE_SECS)
+		msglen = 0;
+	int x = editor_draw_text(e.screenrows + 1, 0, e.statusmsg, msglen, CELL_DEFAULT);
+	editor_clear_line(e.screenrows + 1, x);
+}
+
+void editor_init_sgr() {
+	for (int color = 0; color < CELL_REVERSE; color++) {
+		struct sgr_seq *seq = e.sgr[SGR_COLOR];
+		seq[color].len = snprintf(seq[color].s, sizeof(seq[color].s), "\x1b[%dm", color);
+		seq = e.sgr[SGR_RESET];
+		seq[color].len = snprintf(seq[color].s, sizeof(seq[color].s), "\x1b[0;%dm", color);
+		seq = e.sgr[SGR_REVERSE];
+		seq[color].len = snprintf(seq[color].s, sizeof(seq[color].s), "\x1b[7;%dm", color);
+	}
+}
+
+void editor_term_attr(struct abuf *ab, int attr) {
+	if (attr == e.term_attr)
+		return;
+	int kind = SGR_COLOR;
+	if ((e.term_attr & CELL_REVERSE) && !(attr & CELL_REVERSE))
+		kind = SGR_RESET;
+	else if ((attr & CELL_REVERSE) && !(e.term_attr & CELL_REVERSE))
+		kind = SGR_REVERSE;
+	struct sgr_seq *seq = &e.sgr[kind][attr & ~CELL_REVERSE];
+	ab_append(ab, seq->s, seq->len);
+	e.term_attr = attr;
+}
+
+int editor_line_plain(struct cell *line, int len) {
+	for (int x = 0; x < len; x++) {
+		unsigned char c = line[x].c[0];
+		int n = (c < 0x80) ? 1 : (c < 0xE0) ? 2 : (c < 0xF0) ? 3 : 4;
+		if (line[x].len != n || (x + 1 < e.screencols && line[x + 1].len == 0))
+			return 0;
+	}
+	return 1;
+}
+
+void editor_term_move(struct abuf *ab, int y, int x) {
+	if (y == e.term_y && x == e.term_x)
+		return;
+	if (y == e.term_y && e.term_x >= 0 && x > e.term_x && x - e.term_x <= 4 && editor_line_plain(&e.screen[y * e.screencols], e.screencols)) {
+		struct cell *cell = &e.screen[y * e.screencols + e.term_x];
+		int j;
+		for (j = 0; j < x - e.term_x; j++)
+			if (cell[j].attr != e.term_attr)
+				break;
+		if (j == x - e.term_x) {
+			for (j = 0; j < x - e.term_x; j++)
+				ab_append(ab, cell[j].c, cell[j].len);
+			e.term_x = x;
+			return;
+		}
+	}
+	if (y == e.term_y && e.term_x >= 0 && x > e.term_x) {
+		ab_append(ab, "\x1b[", 2);
+		ab_append_int(ab, x - e.term_x);
+		ab_append(ab, "C", 1);
+	} else if (y == e.term_y + 1 && x == 0)
+		ab_append(ab, "\r\n", 2);
+	else {
+		ab_append(ab, "\x1b[", 2);
+		ab_append_int(ab, y + 1);
+		ab_append(ab, ";", 1);
+		ab_append_int(ab, x + 1);
+		ab_append(ab, "H", 1);
+	}
+	e.term_y = y;
+	e.term_x = x;
+}
+
+void editor_term_put(struct abuf *ab, struct cell *cell, int y, int x) {
+	editor_term_move(ab, y, x);
+	editor_term_attr(ab, cell->attr);
+	ab_append(ab, cell->c, cell->len);
+	int w = (x + 1 < e.screencols && cell[1].len == 0) ? 2 : 1;
+	e.term_x = (x + w < e.screencols) ? x + w : -1;
+}
+
+int editor_line_end(struct cell *line) {
+	int x = e.screencols;
+	while (x > 0 && line[x - 1].c[0] == ' ' && line[x - 1].len == 1 && line[x - 1].attr == CELL_DEFAULT)
+		x--;
+	return x;
+}
+
+void editor_flush_line(struct abuf *ab, int y) {
+	struct cell *line = &e.screen[y * e.screencols];
+	struct cell *old = &e.shadow[y * e.screencols];
+	if (!memcmp(line, old, e.screencols * sizeof(struct cell)))
+		return;
+	int end = editor_line_end(line);
+	int old_end = editor_line_end(old);
+	int x;
+	if (!editor_line_plain(line, end) || !editor_line_plain(old, old_end)) {
+		editor_term_move(ab, y, 0);
+		for (x = 0; x < end; x++) {
+			editor_term_attr(ab, line[x].attr);
+			ab_append(ab, line[x].c, line[x].len);
+		}
+		editor_term_attr(ab, CELL_DEFAULT);
+		ab_append(ab, "\x1b[K", 3);
+		e.term_x = -1;
+		return;
+	}
+	for (x = 0; x < end; x++)
+		if (line[x].len && memcmp(&line[x], &old[x], sizeof(struct cell)))
+			editor_term_put(ab, &line[x], y, x);
+	if (old_end > end) {
+		editor_term_move(ab, y, end);
+		editor_term_attr(ab, CELL_DEFAULT);
+		ab_append(ab, "\x1b[K", 3);
+	}
+}
+
+void editor_blank_cells(struct cell *cell, int n) {
+	for (int k = 0; k < n; k++)
+		cell[k] = (struct cell){{' '}, 1, CELL_DEFAULT};
+}
+
+void editor_term_scroll(struct abuf *ab, int n) {
+	int rows = e.screenrows;
+	int cols = e.screencols;
+	if (n == 0 || n >= rows || n <= -rows)
+		return;
+	editor_term_attr(ab, CELL_DEFAULT);
+	ab_append(ab, "\x1b[1;", 4);
+	ab_append_int(ab, rows);
+	ab_append(ab, "r\x1b[", 3);
+	ab_append_int(ab, n > 0 ? n : -n);
+	ab_append(ab, n > 0 ? "S\x1b[r" : "T\x1b[r", 4);
+	e.term_y = e.term_x = 0;
+	if (n > 0) {
+		memmove(e.shadow, &e.shadow[n * cols], (rows - n) * cols * sizeof(struct cell));
+		editor_blank_cells(&e.shadow[(rows - n) * cols], n * cols);
+	} else {
+		memmove(&e.shadow[-n * cols], e.shadow, (rows + n) * cols * sizeof(struct cell));
+		editor_blank_cells(e.shadow, -n * cols);
+	}
+}
+
+void editor_resize() {
+	if (get_window_size(&e.screenrows, &e.screencols) == -1)
+		die_cur("get_window_size");
+	e.screenrows -= 2;
+	if (e.screenrows < 1)
+		e.screenrows = 1;
+	editor_alloc_screen();
 }
 
 void editor_refresh_screen() {
 	editor_scroll();
-	struct abuf ab = ABUF_INIT;
-	ab_append(&ab, "\x1b[?25l", 6);
-	ab_append(&ab, "\x1b[H", 3);
-	editor_draw_rows(&ab);
-	editor_draw_status_bar(&ab);
-	editor_draw_message_bar(&ab);
-	char buf[32];
-	snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (e.cy - e.rowoff) + 1, (e.rx - e.coloff) + 1);
-	ab_append(&ab, buf, strlen(buf));
-	ab_append(&ab, "\x1b[?25h", 6);
-	write(STDOUT_FILENO, ab.b, ab.len);
-	ab_free(&ab);
+	editor_syntax_sync_visible();
+	e.hl_redraw = 0;
+	e.frame_time = editor_clock_ms();
+	editor_draw_rows();
+	editor_draw_status_bar();
+	editor_draw_message_bar();
+	struct abuf *ab = &e.frame;
+	ab->len = 0;
+	ab_append(ab, "\x1b[?2026h", 8);
+	int cells = (e.screenrows + 2) * e.screencols;
+	int repaint = !e.shadow_valid || e.rowoff != e.shadow_rowoff || memcmp(e.screen, e.shadow, cells * sizeof(struct cell));
+	if (repaint)
+		ab_append(ab, "\x1b[?25l", 6);
+	if (!e.shadow_valid) {
+		ab_append(ab, "\x1b[m\x1b[H\x1b[2J", 10);
+		e.term_attr = CELL_DEFAULT;
+		e.term_y = e.term_x = 0;
+		editor_blank_cells(e.shadow, cells);
+		e.shadow_valid = 1;
+	} else if (e.coloff == e.shadow_coloff)
+		editor_term_scroll(ab, e.rowoff - e.shadow_rowoff);
+	e.shadow_rowoff = e.rowoff;
+	e.shadow_coloff = e.coloff;
+	if (repaint) {
+		for (int y = 0; y < e.screenrows + 2; y++)
+			editor_flush_line(ab, y);
+		memcpy(e.shadow, e.screen, cells * sizeof(struct cell));
+	}
+	editor_term_move(ab, e.cy - e.rowoff, e.rx - e.coloff);
+	if (repaint)
+		ab_append(ab, "\x1b[?25h", 6);
+	if (ab->len - 8 > e.screencols) {
+		ab_append(ab, "\x1b[?2026l", 8);
+		write(STDOUT_FILENO, ab->b, ab->len);
+	} else
+		write(STDOUT_FILENO, &ab->b[8], ab->len - 8);
 }
 
 void editor_set_status_message(const char *fmt, ...) {
@@ -873,12 +4542,16 @@ void editor_set_status_message(const char *fmt, ...) {
 	va_start(ap, fmt);
 	vsnprintf(e.statusmsg, sizeof(e.statusmsg), fmt, ap);
 	va_end(ap);
-	e.statusmsg_time = time(NULL);
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	e.statusmsg_time = now.tv_sec;
+	struct itimerspec expiry = {{0, 0}, {e.statusmsg_time + KILO_MESSAGE_SECS, 0}};
+	timerfd_settime(e.timer_fd, TFD_TIMER_ABSTIME, &expiry, NULL);
 }
 
 /* input */
 
-char *editor_prompt(char *prompt, void (*callback)(char *, int)) {
+char *editor_prompt(char *prompt, void (*callback)(char *, int), int allow_empty) {
 	size_t bufsize = 128;
 	char *buf = malloc(bufsize);
 	size_t buflen = 0;
@@ -888,8 +4561,10 @@ char *editor_prompt(char *prompt, void (*callback)(char *, int)) {
 		editor_refresh_screen();
 		int c = editor_read_key();
 		if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
-			if (buflen != 0)
-				buf[--buflen] = '\0';
+			if (buflen != 0) {
+				buflen = editor_utf8_start(buf, buflen, buflen - 1);
+				buf[buflen] = '\0';
+			}
 		} else if (c == '\x1b') {
 			editor_set_status_message("");
 			if (callback)
@@ -897,19 +4572,31 @@ char *editor_prompt(char *prompt, void (*callback)(char *, int)) {
 			free(buf);
 			return NULL;
 		} else if (c == '\r') {
-			if (buflen != 0) {
+			if (buflen != 0 || allow_empty) {
 				editor_set_status_message("");
 				if (callback)
 					callback(buf, c);
 				return buf;
 			}
-		} else if (!iscntrl(c) && c < 128) {
+		} else if (c < 0 || (c < 128 && !iscntrl(c))) {
 			if (buflen == bufsize - 1) {
 				bufsize *= 2;
 				buf = realloc(buf, bufsize);
 			}
 			buf[buflen++] = c;
 			buf[buflen] = '\0';
+		} else if (c == PASTE_KEY) {
+			for (int i = 0; i < e.paste.len; i++) {
+				unsigned char ch = e.paste.b[i];
+				if (iscntrl(ch))
+					continue;
+				if (buflen == bufsize - 1) {
+					bufsize *= 2;
+					buf = realloc(buf, bufsize);
+				}
+				buf[buflen++] = ch;
+				buf[buflen] = '\0';
+			}
 		}
 		if (callback)
 			callback(buf, c);
@@ -917,20 +4604,20 @@ char *editor_prompt(char *prompt, void (*callback)(char *, int)) {
 }
 
 void editor_move_cursor(int key) {
-	erow *row = (e.cy >= e.numrows) ? NULL : &e.row[e.cy];
+	erow *row = editor_row_at(e.cy);
 	switch (key) {
 		case ARROW_LEFT:
 			if (e.cx != 0)
-				e.cx--;
+				e.cx = editor_row_prev_char(row, e.cx);
 			else if (e.cy > 0) {
 				e.cy--;
-				e.cx = e.row[e.cy].size;
+				e.cx = editor_row_at(e.cy)->size;
 			}
 			break;
 
 		case ARROW_RIGHT:
 			if (row && e.cx < row->size)
-				e.cx++;
+				e.cx = editor_row_next_char(row, e.cx);
 			else if (row && e.cx == row->size) {
 				e.cy++;
 				e.cx = 0;
@@ -947,10 +4634,12 @@ void editor_move_cursor(int key) {
 				e.cy++;
 			break;
 	}
-	row = (e.cy >= e.numrows) ? NULL : &e.row[e.cy];
+	row = editor_row_at(e.cy);
 	int rowlen = row ? row->size : 0;
 	if (e.cx > rowlen)
 		e.cx = rowlen;
+	if (row)
+		e.cx = editor_utf8_start(row->chars, row->size, e.cx);
 }
 
 void editor_process_keypress() {
@@ -970,6 +4659,7 @@ void editor_process_keypress() {
 			write(STDOUT_FILENO, "\x1b[999B", 6);
 			write(STDOUT_FILENO, "\x1b[999D", 6);
 			write(STDOUT_FILENO, "\x1b[2K", 4);
+			editor_close();
 			exit(0);
 			break;
 
@@ -983,11 +4673,16 @@ void editor_process_keypress() {
 
 		case END_KEY:
 			if (e.cy < e.numrows)
-				e.cx = e.row[e.cy].size;
+				e.cx = editor_row_at(e.cy)->size;
 			break;
 
 		case CTRL_KEY('f'):
-			editor_find();
+		case CTRL_KEY('g'):
+			editor_find(c == CTRL_KEY('g'));
+			break;
+
+		case CTRL_KEY('r'):
+			editor_replace();
 			break;
 
 		case BACKSPACE:
@@ -1019,7 +4714,14 @@ void editor_process_keypress() {
 			editor_move_cursor(c);
 			break;
 
+		case PASTE_KEY:
+			editor_insert_text(e.paste.b, e.paste.len);
+			break;
+
 		case CTRL_KEY('l'):
+			e.shadow_valid = 0;
+			break;
+
 		case '\x1b':
 			break;
 
@@ -1039,26 +4741,96 @@ void init_editor() {
 	e.rowoff = 0;
 	e.coloff = 0;
 	e.numrows = 0;
-	e.row = NULL;
+	e.root = NULL;
+	e.map = NULL;
+	e.map_size = 0;
+	e.map_lines = NULL;
+	e.map_heap = 0;
+	memset(e.cache, 0, sizeof(e.cache));
+	memset(e.cache_seen, 0, sizeof(e.cache_seen));
+	e.cache_next = 0;
+	e.hl_gen = 1;
+	e.hl_redraw = 0;
+	e.tree_gen = 0;
+	pthread_cond_init(&e.hl_cond, NULL);
+	pthread_mutex_init(&e.pool_lock, NULL);
+	pthread_cond_init(&e.pool_cond, NULL);
+	pthread_cond_init(&e.pool_done, NULL);
 	e.dirty = 0;
 	e.filename = NULL;
 	e.statusmsg[0] = '\0';
 	e.statusmsg_time = 0;
 	e.syntax = NULL;
-	if (get_window_size(&e.screenrows, &e.screencols) == -1)
-		die_cur("get_window_size");
-	e.screenrows -= 2;
+	e.hl = NULL;
+	e.hl_cap = 0;
+	e.hl_runs = NULL;
+	e.hl_runs_cap = 0;
+	e.match_len = 0;
+	e.find_query = NULL;
+	e.find_query_len = 0;
+	e.find_lines = NULL;
+	e.find_count = 0;
+	e.find_cap = 0;
+	e.find_active = 0;
+	e.find_parts = NULL;
+	e.find_part_count = 0;
+	e.find_part_cap = 0;
+	e.find_batches = NULL;
+	e.find_batch_count = 0;
+	e.find_batch_cap = 0;
+	e.find_workers = 0;
+	e.find_busy = 0;
+	e.find_gen = 0;
+	e.find_running = 0;
+	e.find_source = NULL;
+	e.find_source_count = 0;
+	e.find_found = 0;
+	pthread_mutex_init(&e.find_lock, NULL);
+	pthread_cond_init(&e.find_cond, NULL);
+	pthread_cond_init(&e.find_idle, NULL);
+	e.find_index = NULL;
+	e.find_index_count = 0;
+	e.find_index_cap = 0;
+	e.find_merged = 0;
+	memset(&e.needle, 0, sizeof(e.needle));
+	e.screen = NULL;
+	e.shadow = NULL;
+	e.frame = (struct abuf)ABUF_INIT;
+	e.input_head = e.input_tail = 0;
+	e.key_head = e.key_tail = 0;
+	e.paste = (struct abuf)ABUF_INIT;
+	e.pasting = 0;
+	e.frame_time = 0;
+	e.frame_rate = KILO_FRAME_RATE;
+	e.arena = NULL;
+	e.arena_left = 0;
+	memset(e.slab_free, 0, sizeof(e.slab_free));
+	editor_select_scan();
+	editor_select_search();
+	editor_syntax_init();
+	editor_init_sgr();
+	editor_open_events();
+	editor_resize();
 }
 
 int main(int argc, char *argv[]) {
 	enable_raw_mode();
+	pthread_mutex_init(&e.lock, NULL);
+	pthread_mutex_lock(&e.lock);
 	init_editor();
+	char *rate = getenv("KILO_FRAME_RATE");
+	if (rate && atoi(rate) > 0)
+		e.frame_rate = atoi(rate);
 	if (argc > 1)
 		editor_open(argv[1]);
-	editor_set_status_message("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+	editor_syntax_start();
+	editor_set_status_message("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F/G = find/regex | Ctrl-R = replace");
 	while (1) {
 		editor_refresh_screen();
-		editor_process_keypress();
+		do {
+			editor_process_keypress();
+			editor_scroll();
+		} while (editor_input_pending());
 	}
 	return 0;
 }
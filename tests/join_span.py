@@ -0,0 +1,52 @@
+#!/usr/bin/env python3
+# Backspace at column 0 joins the cursor row onto the previous one. When
+# that row still lives in an unmaterialized mmap span the join must
+# materialize it first; see editor_del_char.
+import os, pty, select, sys, tempfile, time, fcntl, termios, struct
+
+def drain(fd, quiet):
+    out = b''
+    while True:
+        r, _, _ = select.select([fd], [], [], quiet)
+        if not r:
+            return out
+        try:
+            chunk = os.read(fd, 65536)
+        except OSError:
+            return out
+        if not chunk:
+            return out
+        out += chunk
+
+def main():
+    binary = sys.argv[1] if len(sys.argv) > 1 else './easypoetry'
+    lines = ['line%d' % i for i in range(1, 3001)]
+    fd, path = tempfile.mkstemp(suffix='.txt')
+    os.write(fd, ('\n'.join(lines) + '\n').encode())
+    os.close(fd)
+    pid, master = pty.fork()
+    if pid == 0:
+        os.execv(binary, [binary, path])
+    fcntl.ioctl(master, termios.TIOCSWINSZ, struct.pack('HHHH', 24, 80, 0, 0))
+    drain(master, 0.5)
+    os.write(master, b'\x06line1000')
+    drain(master, 0.3)
+    os.write(master, b'\r')
+    drain(master, 0.3)
+    os.write(master, b'\x1b[5~\x1b[H\x7f')
+    drain(master, 0.3)
+    os.write(master, b'\x13')
+    drain(master, 0.3)
+    os.write(master, b'\x11\x11\x11\x11')
+    drain(master, 0.3)
+    os.waitpid(pid, 0)
+    saved = open(path).read().split('\n')[:-1]
+    os.unlink(path)
+    for k in range(1, len(lines)):
+        if saved == lines[:k - 1] + [lines[k - 1] + lines[k]] + lines[k + 1:]:
+            print('ok: joined line %d onto line %d' % (k + 1, k))
+            return 0
+    print('FAIL: saved file is not the original with one join')
+    return 1
+
+sys.exit(main())